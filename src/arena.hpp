@@ -1,36 +1,64 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
+#include <span>
 
+#include <sys/mman.h>
+
+// bump allocator for parse tree nodes, nothing allocated from it is ever destroyed
+// memory comes in a chain of mapped blocks, each twice the size of the one before, so small programs map little
+// and large ones need few blocks
+// reset() rewinds to the first block and keeps the chain, so the next use runs through the same memory again
 class ArenaAllocator
 {
 
 public:
-    explicit ArenaAllocator(const size_t bytes)
-        : m_size{bytes},
-          m_buffer{new std::byte[bytes]},
-          m_offset{m_buffer}
+    // usage counters, bytes are counted from the start of the first block through the current position
+    struct Stats
+    {
+        size_t blocks = 0;          // blocks mapped
+        size_t reserved = 0;        // bytes mapped for blocks
+        size_t allocations = 0;     // objects handed out since construction
+        size_t used = 0;            // bytes in use now, including alignment and unused block tails
+        size_t high_water = 0;      // most bytes ever in use at once
+        size_t alignment_waste = 0; // padding inserted to align objects since construction
+    };
+
+    // huge_pages asks for huge pages on blocks large enough to hold one
+    explicit ArenaAllocator(const size_t first_block = 64 * 1024, const bool huge_pages = false)
+        : m_first_size(std::max(first_block, sizeof(Block) + alignof(std::max_align_t))),
+          m_huge_pages(huge_pages)
     {
     }
 
-    ArenaAllocator(const ArenaAllocator &t); // deleting copy constructor
+    ArenaAllocator(const ArenaAllocator &) = delete;
     ArenaAllocator &operator=(const ArenaAllocator &) = delete;
 
-    template <typename T>
-    [[nodiscard]] T *alloc()
+    // raw memory for bytes with the given alignment
+    [[nodiscard]] void *allocate(const size_t bytes, const size_t align)
     {
-        // calculate available allocated memory
-        size_t rem_bytes = m_size - static_cast<size_t>(m_offset - m_buffer);
-        auto ptr = static_cast<void *>(m_offset);
-        // calculate alignment bytes for type T
-        const auto aligned_address = std::align(alignof(T), sizeof(T), ptr, rem_bytes);
-        if (aligned_address == nullptr)
+        std::byte *aligned = align_up(m_offset, align);
+        if (m_block == nullptr || aligned + bytes > m_end)
         {
-            throw std::bad_alloc{};
+            next_block(bytes + align);
+            aligned = align_up(m_offset, align);
         }
-        // moving offset to match the aligned bytes + size of T
-        m_offset = static_cast<std::byte *>(aligned_address) + sizeof(T);
-        return static_cast<T *>(aligned_address);
+        m_stats.alignment_waste += static_cast<size_t>(aligned - m_offset);
+        m_stats.used += static_cast<size_t>(aligned - m_offset) + bytes;
+        m_stats.high_water = std::max(m_stats.high_water, m_stats.used);
+        m_stats.allocations++;
+        m_offset = aligned + bytes;
+        return aligned;
+    }
+
+    template <typename T>
+    [[nodiscard]] T *alloc()
+    {
+        return static_cast<T *>(allocate(sizeof(T), alignof(T)));
     }
 
     template <typename T, typename... Args>
@@ -41,14 +69,130 @@ public:
         return new (allocated_memory) T{std::forward<Args>(args)...};
     }
 
-    // destructor
+    // uninitialised array of count objects
+    template <typename T>
+    [[nodiscard]] std::span<T> alloc_array(const size_t count)
+    {
+        if (count == 0)
+        {
+            return {};
+        }
+        return {static_cast<T *>(allocate(count * sizeof(T), alignof(T))), count};
+    }
+
+    // copies items into the arena, for sequences whose length is only known once they are parsed
+    template <typename T>
+    [[nodiscard]] std::span<T> copy(const std::span<const T> items)
+    {
+        const std::span<T> array = alloc_array<T>(items.size());
+        std::uninitialized_copy(items.begin(), items.end(), array.begin());
+        return array;
+    }
+
+    // forgets everything allocated, the blocks stay mapped for reuse
+    void reset()
+    {
+        m_block = m_first;
+        m_offset = m_block != nullptr ? m_block->data() : nullptr;
+        m_end = m_block != nullptr ? m_block->end() : nullptr;
+        m_stats.used = 0;
+    }
+
+    [[nodiscard]] const Stats &stats() const
+    {
+        return m_stats;
+    }
+
     ~ArenaAllocator()
     {
-        delete[] m_buffer;
+        for (Block *block = m_first; block != nullptr;)
+        {
+            Block *next = block->next;
+            munmap(block, block->size);
+            block = next;
+        }
     }
 
 private:
-    size_t m_size;       // size of allocated memory
-    std::byte *m_buffer; // pointer to allocated memory
-    std::byte *m_offset; // pointer to available allocated memory
-};
\ No newline at end of file
+    // header at the start of every block
+    struct Block
+    {
+        Block *next;
+        size_t size; // including the header
+
+        std::byte *data()
+        {
+            return reinterpret_cast<std::byte *>(this) + sizeof(Block);
+        }
+
+        std::byte *end()
+        {
+            return reinterpret_cast<std::byte *>(this) + size;
+        }
+    };
+
+    static std::byte *align_up(std::byte *p, const size_t align)
+    {
+        const auto address = reinterpret_cast<uintptr_t>(p);
+        return p + ((align - address % align) % align);
+    }
+
+    // moves to the next block with room for bytes, reusing blocks kept by reset() before mapping a new one
+    void next_block(const size_t bytes)
+    {
+        if (m_block != nullptr)
+        {
+            // the unused tail of the current block counts as used until the next reset
+            m_stats.used += static_cast<size_t>(m_end - m_offset);
+        }
+        Block *next = m_block != nullptr ? m_block->next : m_first;
+        if (next == nullptr || next->size - sizeof(Block) < bytes)
+        {
+            const size_t size = std::max(m_block != nullptr ? m_block->size * 2 : m_first_size, bytes + sizeof(Block));
+            Block *block = map(size);
+            block->next = next;
+            (m_block != nullptr ? m_block->next : m_first) = block;
+            next = block;
+        }
+        m_block = next;
+        m_offset = m_block->data();
+        m_end = m_block->end();
+    }
+
+    Block *map(size_t size)
+    {
+        constexpr size_t huge_page = 2 * 1024 * 1024;
+        void *addr = MAP_FAILED;
+        if (m_huge_pages && size >= huge_page)
+        {
+            size = (size + huge_page - 1) / huge_page * huge_page;
+            // explicit huge pages need pages reserved by the system, transparent ones are the fallback
+            addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+        if (addr == MAP_FAILED)
+        {
+            addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (addr == MAP_FAILED)
+            {
+                throw std::bad_alloc{};
+            }
+            if (m_huge_pages && size >= huge_page)
+            {
+                madvise(addr, size, MADV_HUGEPAGE);
+            }
+        }
+        m_stats.blocks++;
+        m_stats.reserved += size;
+        auto *block = static_cast<Block *>(addr);
+        block->size = size;
+        return block;
+    }
+
+    size_t m_first_size;           // size of the first block
+    bool m_huge_pages;
+    Block *m_first = nullptr;      // chain of blocks in the order they are used
+    Block *m_block = nullptr;      // block being allocated from
+    std::byte *m_offset = nullptr; // next free byte in m_block
+    std::byte *m_end = nullptr;    // end of m_block
+    Stats m_stats{};
+};
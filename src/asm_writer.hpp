@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <cerrno>
+#include <unistd.h>
+
+// append-only buffer for generated assembly
+// text goes into fixed size chunks, so growing never copies what was written before
+// with a file descriptor every full chunk is written out and reused, so the program is never held in memory whole,
+// without one the chunks are kept until take() joins them
+class AsmWriter
+{
+
+public:
+    // collects the text in memory
+    AsmWriter() = default;
+
+    // streams the text to fd, which stays open and owned by the caller
+    explicit AsmWriter(const int fd)
+        : m_fd(fd)
+    {
+    }
+
+    AsmWriter(const AsmWriter &) = delete;
+    AsmWriter &operator=(const AsmWriter &) = delete;
+
+    AsmWriter &operator<<(const std::string_view text)
+    {
+        for (size_t done = 0; done < text.size();)
+        {
+            if (m_used == chunk_size || m_chunks.empty())
+            {
+                next_chunk();
+            }
+            const size_t n = std::min(text.size() - done, chunk_size - m_used);
+            std::memcpy(m_chunks.back().get() + m_used, text.data() + done, n);
+            m_used += n;
+            done += n;
+        }
+        return *this;
+    }
+
+    AsmWriter &operator<<(const char c)
+    {
+        return *this << std::string_view(&c, 1);
+    }
+
+    // integers are formatted by hand, without locales or stream state
+    template <std::integral T>
+        requires(!std::same_as<T, bool>)
+    AsmWriter &operator<<(const T value)
+    {
+        char digits[24];
+        char *end = digits + sizeof(digits);
+        char *p = end;
+        // the magnitude is taken unsigned, so the most negative value does not overflow
+        const bool negative = std::is_signed_v<T> && value < 0;
+        auto magnitude = static_cast<std::make_unsigned_t<T>>(value);
+        if (negative)
+        {
+            magnitude = static_cast<std::make_unsigned_t<T>>(0 - magnitude);
+        }
+        do
+        {
+            *--p = static_cast<char>('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude != 0);
+        if (negative)
+        {
+            *--p = '-';
+        }
+        return *this << std::string_view(p, static_cast<size_t>(end - p));
+    }
+
+    // writes out what is buffered, only meaningful when streaming
+    void flush()
+    {
+        if (m_fd >= 0 && !m_chunks.empty())
+        {
+            write_all(m_chunks.back().get(), m_used);
+            m_used = 0;
+        }
+    }
+
+    // text written since the last call, when collecting in memory
+    std::string take()
+    {
+        std::string text;
+        if (!m_chunks.empty())
+        {
+            text.reserve((m_chunks.size() - 1) * chunk_size + m_used);
+            for (size_t i = 0; i + 1 < m_chunks.size(); i++)
+            {
+                text.append(m_chunks[i].get(), chunk_size);
+            }
+            text.append(m_chunks.back().get(), m_used);
+            // the first chunk is kept for what comes next
+            m_chunks.resize(1);
+            m_used = 0;
+        }
+        return text;
+    }
+
+private:
+    static constexpr size_t chunk_size = 64 * 1024;
+
+    void next_chunk()
+    {
+        if (m_fd >= 0 && !m_chunks.empty())
+        {
+            flush();
+            return;
+        }
+        m_chunks.push_back(std::make_unique_for_overwrite<char[]>(chunk_size));
+        m_used = 0;
+    }
+
+    void write_all(const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t n = write(m_fd, data, size);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                std::cerr << "Unable to write assembly code" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    int m_fd = -1;                                 // file streamed to, -1 when collecting in memory
+    std::vector<std::unique_ptr<char[]>> m_chunks; // full chunks followed by the one being filled
+    size_t m_used = 0;                             // bytes used in the last chunk
+};
@@ -0,0 +1,533 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "./parser.hpp"
+
+// parse trees saved on disk under a hash of their source, so compiling an unchanged source skips the tokenizer
+// and the parser
+// a cache file holds the texts of the string table, the expression pool and the statements, all at fixed offsets
+// with no pointers, so it is mapped as it is: texts and expressions are used in place and only the statement
+// nodes are rebuilt, without looking at a single token
+// the file holds the source too and is only used when it is the same, byte for byte, so sources whose hashes collide
+// never get each other's tree
+// files that do not match the source or this build of blue, or whose contents changed since they were written, are
+// ignored and written again
+class AstCache
+{
+
+public:
+    explicit AstCache(const std::string_view source)
+        : m_source(source), m_hash(hash(source))
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.ast", static_cast<unsigned long long>(m_hash));
+        m_path = std::string(dir) + "/" + name;
+    }
+
+    AstCache(const AstCache &) = delete;
+    AstCache &operator=(const AstCache &) = delete;
+
+    // tree saved for the source, its texts are in strings()
+    std::optional<NodeProg> load()
+    {
+        if (!map())
+        {
+            return {};
+        }
+        Reader reader{*this};
+        const std::optional<NodeProg> prog = reader.prog();
+        if (!prog.has_value())
+        {
+            std::cerr << "Ignoring damaged cache file " << m_path << std::endl;
+        }
+        return prog;
+    }
+
+    [[nodiscard]] const StringTable &strings() const
+    {
+        return m_strings;
+    }
+
+    // saves a tree parsed from the source, failing to write the cache does not fail the compile
+    void save(const NodeProg &prog, const std::span<const NodeExpr> exprs, const StringTable &strings) const
+    {
+        Header header{};
+        std::memcpy(header.magic, magic, sizeof(header.magic));
+        header.version = version;
+        header.expr_size = sizeof(NodeExpr);
+        header.source_hash = m_hash;
+        header.source_bytes = m_source.size();
+        header.string_count = strings.size();
+        header.expr_count = exprs.size();
+
+        std::vector<uint32_t> string_ends;
+        std::string texts;
+        string_ends.reserve(strings.size());
+        for (uint32_t id = 0; id < strings.size(); id++)
+        {
+            texts += strings.text(id);
+            string_ends.push_back(static_cast<uint32_t>(texts.size()));
+        }
+        header.string_bytes = texts.size();
+
+        Writer writer{exprs.data()};
+        writer.words.push_back(static_cast<uint32_t>(prog.stmts.size()));
+        for (const NodeStmt *stmt : prog.stmts)
+        {
+            writer.stmt(stmt);
+        }
+        header.stmt_words = writer.words.size();
+
+        std::string payload;
+        const auto append = [&](const void *data, const size_t bytes)
+        {
+            payload.append(static_cast<const char *>(data), bytes);
+            payload.resize(align(payload.size()), '\0');
+        };
+        append(m_source.data(), m_source.size());
+        append(string_ends.data(), string_ends.size() * sizeof(uint32_t));
+        append(texts.data(), texts.size());
+        append(exprs.data(), exprs.size_bytes());
+        append(writer.words.data(), writer.words.size() * sizeof(uint32_t));
+        header.payload_hash = hash(payload);
+
+        // written to a temporary file and renamed, so a concurrent compile never maps half a file
+        mkdir(dir, 0755);
+        const std::string temp = m_path + "." + std::to_string(getpid());
+        FILE *file = std::fopen(temp.c_str(), "wb");
+        if (file == nullptr)
+        {
+            return;
+        }
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = ok && std::fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok || std::rename(temp.c_str(), m_path.c_str()) != 0)
+        {
+            std::remove(temp.c_str());
+        }
+    }
+
+    ~AstCache()
+    {
+        if (m_data != nullptr)
+        {
+            munmap(const_cast<std::byte *>(m_data), m_size);
+        }
+    }
+
+private:
+    static constexpr const char *dir = ".blue-cache";
+    static constexpr char magic[8] = {'B', 'L', 'U', 'E', 'A', 'S', 'T', '\0'};
+    static constexpr uint32_t version = 1;
+
+    // sections follow the header in this order, each starting at a multiple of 8 bytes:
+    // source_bytes bytes of the source, string_count end offsets of the texts, the texts, expr_count expression nodes, stmt_words statement words
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t expr_size; // sizeof(NodeExpr) of the build that wrote the file
+        uint64_t source_hash;
+        uint64_t payload_hash; // hash of everything after the header, catches damaged files
+        uint64_t source_bytes;
+        uint64_t string_count;
+        uint64_t string_bytes;
+        uint64_t expr_count;
+        uint64_t stmt_words;
+    };
+
+    // statements are written depth first as 32-bit words, a statement starts with the index of its kind in
+    // NodeStmt::var, tokens take three words, expressions are the index of their root in the pool and sequences
+    // start with their length
+    struct Writer
+    {
+        const NodeExpr *pool;
+        std::vector<uint32_t> words{};
+
+        void token(const Token &token)
+        {
+            words.push_back(static_cast<uint32_t>(token.type));
+            words.push_back(token.pos);
+            words.push_back(token.value);
+        }
+
+        void expr(const ExprRef &expr)
+        {
+            assert(expr.pool == pool);
+            words.push_back(expr.root);
+        }
+
+        void scope(const NodeScope *scope)
+        {
+            words.push_back(static_cast<uint32_t>(scope->stmts.size()));
+            for (const NodeStmt *stmt : scope->stmts)
+            {
+                this->stmt(stmt);
+            }
+        }
+
+        void stmt(const NodeStmt *stmt)
+        {
+            words.push_back(static_cast<uint32_t>(stmt->var.index()));
+            std::visit(*this, stmt->var);
+        }
+
+        void operator()(const NodeStmtExit *stmt_exit)
+        {
+            expr(stmt_exit->expr);
+        }
+
+        void operator()(const NodeStmtLet *stmt_let)
+        {
+            token(stmt_let->ident);
+            expr(stmt_let->expr);
+        }
+
+        void operator()(const NodeScope *node_scope)
+        {
+            scope(node_scope);
+        }
+
+        void operator()(const NodeStmtIf *stmt_if)
+        {
+            // the elif and else that follow are tagged 1 and 2, 0 ends the chain
+            expr(stmt_if->expr);
+            scope(stmt_if->scope);
+            for (const NodeIfPred *pred = stmt_if->pred.value_or(nullptr); pred != nullptr;)
+            {
+                if (const auto *elif = std::get_if<NodeIfPredElif *>(&pred->var))
+                {
+                    words.push_back(1);
+                    expr((*elif)->expr);
+                    scope((*elif)->scope);
+                    pred = (*elif)->pred.value_or(nullptr);
+                }
+                else
+                {
+                    words.push_back(2);
+                    scope(std::get<NodeIfPredElse *>(pred->var)->scope);
+                    pred = nullptr;
+                }
+            }
+            words.push_back(0);
+        }
+
+        void operator()(const NodeStmtAssign *stmt_assign)
+        {
+            token(stmt_assign->ident);
+            expr(stmt_assign->expr);
+        }
+
+        void operator()(const NodeStmtPrint *stmt_print)
+        {
+            expr(stmt_print->expr);
+        }
+
+        void operator()(const NodeFunction *function)
+        {
+            token(function->function_name->ident);
+            words.push_back(static_cast<uint32_t>(function->parameters.size()));
+            for (const NodeTermIdent *parameter : function->parameters)
+            {
+                token(parameter->ident);
+            }
+            scope(function->scope);
+        }
+
+        void operator()(const NodeFunctionCall *function_call)
+        {
+            token(function_call->function_name->ident);
+            words.push_back(static_cast<uint32_t>(function_call->arguments.size()));
+            for (const ExprRef &argument : function_call->arguments)
+            {
+                expr(argument);
+            }
+        }
+    };
+
+    // rebuilds statement nodes from the words, checking every count and index against the file
+    struct Reader
+    {
+        AstCache &cache;
+        size_t at = 0;
+        bool ok = true;
+
+        std::optional<NodeProg> prog()
+        {
+            NodeProg prog;
+            prog.stmts = stmts(count());
+            if (!ok || at != cache.m_words.size())
+            {
+                return {};
+            }
+            return prog;
+        }
+
+        uint32_t word()
+        {
+            if (at >= cache.m_words.size())
+            {
+                ok = false;
+                return 0;
+            }
+            return cache.m_words[at++];
+        }
+
+        // length of a sequence, each item takes at least one word
+        uint32_t count()
+        {
+            const uint32_t n = word();
+            if (n > cache.m_words.size() - at)
+            {
+                ok = false;
+                return 0;
+            }
+            return n;
+        }
+
+        Token token()
+        {
+            Token token{};
+            token.type = static_cast<TokenType>(word());
+            token.pos = word();
+            token.value = word();
+            ok = ok && (!has_text(token.type) || token.value < cache.m_strings.size());
+            return token;
+        }
+
+        ExprRef expr()
+        {
+            const uint32_t root = word();
+            ok = ok && root < cache.m_exprs.size();
+            return {cache.m_exprs.data(), root};
+        }
+
+        std::span<NodeStmt *> stmts(const uint32_t n)
+        {
+            const std::span<NodeStmt *> stmts = cache.m_arena.alloc_array<NodeStmt *>(n);
+            for (NodeStmt *&stmt : stmts)
+            {
+                stmt = ok ? this->stmt() : nullptr;
+            }
+            return stmts;
+        }
+
+        NodeScope *scope()
+        {
+            auto scope = cache.m_arena.emplace<NodeScope>();
+            scope->stmts = stmts(count());
+            return scope;
+        }
+
+        NodeStmt *stmt()
+        {
+            ArenaAllocator &arena = cache.m_arena;
+            switch (word())
+            {
+            case 0:
+                return arena.emplace<NodeStmt>(arena.emplace<NodeStmtExit>(expr()));
+            case 1:
+            {
+                auto stmt_let = arena.emplace<NodeStmtLet>(token());
+                stmt_let->expr = expr();
+                return arena.emplace<NodeStmt>(stmt_let);
+            }
+            case 2:
+                return arena.emplace<NodeStmt>(scope());
+            case 3:
+            {
+                auto stmt_if = arena.emplace<NodeStmtIf>();
+                stmt_if->expr = expr();
+                stmt_if->scope = scope();
+                std::optional<NodeIfPred *> *link = &stmt_if->pred;
+                for (uint32_t tag = word(); ok && tag != 0; tag = word())
+                {
+                    if (tag == 1)
+                    {
+                        auto if_pred_elif = arena.emplace<NodeIfPredElif>();
+                        if_pred_elif->expr = expr();
+                        if_pred_elif->scope = scope();
+                        *link = arena.emplace<NodeIfPred>(if_pred_elif);
+                        link = &if_pred_elif->pred;
+                    }
+                    else
+                    {
+                        ok = ok && tag == 2;
+                        *link = arena.emplace<NodeIfPred>(arena.emplace<NodeIfPredElse>(scope()));
+                        ok = ok && word() == 0;
+                        break;
+                    }
+                }
+                return arena.emplace<NodeStmt>(stmt_if);
+            }
+            case 4:
+            {
+                auto stmt_assign = arena.emplace<NodeStmtAssign>(token());
+                stmt_assign->expr = expr();
+                return arena.emplace<NodeStmt>(stmt_assign);
+            }
+            case 5:
+                return arena.emplace<NodeStmt>(arena.emplace<NodeStmtPrint>(expr()));
+            case 6:
+            {
+                auto function_name = arena.emplace<NodeTermIdent>(token());
+                const std::span<NodeTermIdent *> parameters = arena.alloc_array<NodeTermIdent *>(count());
+                for (NodeTermIdent *&parameter : parameters)
+                {
+                    parameter = arena.emplace<NodeTermIdent>(token());
+                }
+                return arena.emplace<NodeStmt>(arena.emplace<NodeFunction>(function_name, parameters, scope()));
+            }
+            case 7:
+            {
+                auto function_name = arena.emplace<NodeTermIdent>(token());
+                const std::span<ExprRef> arguments = arena.alloc_array<ExprRef>(count());
+                for (ExprRef &argument : arguments)
+                {
+                    argument = expr();
+                }
+                return arena.emplace<NodeStmt>(arena.emplace<NodeFunctionCall>(function_name, arguments));
+            }
+            default:
+                ok = false;
+                return arena.emplace<NodeStmt>(arena.emplace<NodeScope>());
+            }
+        }
+    };
+
+    // eight bytes at a time, each mixed in with the splitmix64 finalizer, whose shifts right carry every bit of a
+    // chunk into every bit of the hash, a multiplication alone only carries bits upwards
+    static uint64_t hash(const std::string_view bytes)
+    {
+        const auto mix = [](uint64_t z)
+        {
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        };
+        uint64_t h = mix(bytes.size());
+        size_t i = 0;
+        for (; i + 8 <= bytes.size(); i += 8)
+        {
+            uint64_t chunk;
+            std::memcpy(&chunk, bytes.data() + i, sizeof(chunk));
+            h = mix(h ^ chunk);
+        }
+        uint64_t tail = 0;
+        if (i < bytes.size())
+        {
+            std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+        }
+        return mix(h ^ tail);
+    }
+
+    static size_t align(const size_t bytes)
+    {
+        return (bytes + 7) & ~size_t{7};
+    }
+
+    // maps the cache file and checks its header, sections and expression pool
+    bool map()
+    {
+        const int fd = open(m_path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st{};
+        void *addr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header))
+        {
+            addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (addr == MAP_FAILED)
+        {
+            return false;
+        }
+        m_data = static_cast<const std::byte *>(addr);
+        m_size = static_cast<size_t>(st.st_size);
+
+        Header header{};
+        std::memcpy(&header, m_data, sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version ||
+            header.expr_size != sizeof(NodeExpr) || header.source_hash != m_hash ||
+            header.payload_hash != hash({reinterpret_cast<const char *>(m_data) + sizeof(Header), m_size - sizeof(Header)}))
+        {
+            return false;
+        }
+        // every count is checked against the file size before anything is multiplied by it
+        size_t offset = sizeof(Header);
+        const auto section = [&](const uint64_t count, const size_t size) -> const std::byte *
+        {
+            if (count > (m_size - offset) / size)
+            {
+                return nullptr;
+            }
+            const std::byte *start = m_data + offset;
+            offset = std::min(m_size, align(offset + count * size));
+            return start;
+        };
+        const auto *source = reinterpret_cast<const char *>(section(header.source_bytes, 1));
+        if (source == nullptr || std::string_view(source, header.source_bytes) != m_source)
+        {
+            return false;
+        }
+        const auto *ends = reinterpret_cast<const uint32_t *>(section(header.string_count, sizeof(uint32_t)));
+        const auto *texts = reinterpret_cast<const char *>(section(header.string_bytes, 1));
+        const auto *exprs = reinterpret_cast<const NodeExpr *>(section(header.expr_count, sizeof(NodeExpr)));
+        const auto *words = reinterpret_cast<const uint32_t *>(section(header.stmt_words, sizeof(uint32_t)));
+        if (ends == nullptr || texts == nullptr || exprs == nullptr || words == nullptr || offset != m_size)
+        {
+            return false;
+        }
+        // texts are interned in id order, so they get back the ids they were saved with
+        for (uint32_t id = 0, begin = 0; id < header.string_count; begin = ends[id++])
+        {
+            if (ends[id] < begin || ends[id] > header.string_bytes)
+            {
+                return false;
+            }
+            if (m_strings.intern({texts + begin, ends[id] - begin}) != id)
+            {
+                return false;
+            }
+        }
+        m_exprs = {exprs, header.expr_count};
+        m_words = {words, header.stmt_words};
+        // leaves name a text and operations refer to nodes before them, as the parser built them
+        for (uint32_t id = 0; id < m_exprs.size(); id++)
+        {
+            const NodeExpr &expr = m_exprs[id];
+            if (expr.op > ExprOp::mod || (is_leaf(expr.op) ? expr.lhs >= m_strings.size() : expr.lhs >= id || expr.rhs >= id))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string_view m_source; // source being compiled, mapped for as long as the cache lives
+    uint64_t m_hash;
+    std::string m_path;
+    const std::byte *m_data = nullptr; // mapped cache file
+    size_t m_size = 0;
+    StringTable m_strings;              // texts of the loaded tree, viewing into the mapping
+    std::span<const NodeExpr> m_exprs;  // expression pool of the loaded tree, in the mapping
+    std::span<const uint32_t> m_words;  // statements of the loaded tree, in the mapping
+    ArenaAllocator m_arena;             // statement nodes of the loaded tree
+};
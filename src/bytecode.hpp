@@ -0,0 +1,542 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./diagnostics.hpp"
+#include "./ir.hpp"
+#include "./string_table.hpp"
+
+// register-based bytecode, run by run_bytecode() where assembling and linking would take longer than the program
+// every operand is a register of one file that holds the temporaries of a statement, the constants of the program
+// and the top-level variables, so instructions read variables and constants where they are and write variables
+// directly, the loads and stores of the IR mostly disappear into the instructions using the values
+enum class BcOp : uint8_t
+{
+    move, // r[a] = r[b]
+    add,  // r[a] = r[b] + r[c]
+    sub,  // r[a] = r[b] - r[c]
+    mul,  // r[a] = r[b] * r[c], low 64 bits
+    udiv, // r[a] = r[b] / r[c]
+    urem, // r[a] = r[b] % r[c]
+    jmp,  // to instruction a
+    jz,   // to instruction a if r[b] is 0
+    jnz,  // to instruction a if r[b] is not 0
+    jeq,  // to instruction a if r[b] == r[c], a sub and a br on its result in one
+    jne,  // to instruction a if r[b] != r[c], likewise
+    exit, // ends the program with status r[a]
+};
+
+struct BcInst
+{
+    BcOp op;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+};
+
+// a program as run_bytecode() takes it
+struct Bytecode
+{
+    std::vector<BcInst> code;
+    std::vector<uint64_t> registers; // initial values, the constants where they are and 0 elsewhere
+};
+
+// lowers the IR of each top-level statement to bytecode, the program is complete with finish()
+// a value gets a register where its instruction is, a temporary unless it can be a register that exists anyway:
+// a constant is the register holding it, a load is the register of its variable while no store to the variable
+// comes between the load and its last use, a value only stored to a variable is written there by its instruction
+// a temporary read once is reused for the result of the instruction reading it, as in instruction selection
+class BytecodeCompiler
+{
+
+public:
+    struct Stats
+    {
+        size_t temporaries = 0;    // registers for temporaries, as many as the statement needing most takes
+        size_t constants = 0;      // registers holding constants
+        size_t variables = 0;      // registers of top-level variables
+        size_t fused_loads = 0;    // loads that read the register of their variable
+        size_t fused_stores = 0;   // stores whose value is written to the variable by the instruction defining it
+        size_t fused_branches = 0; // subs and brs on their result that became jeq or jne
+    };
+
+    explicit BytecodeCompiler(const StringTable &strings)
+        : m_strings(strings)
+    {
+    }
+
+    // appends the code of the live blocks of fn, a top-level variable it pushes is given slot push_slot
+    void lower(const IrFunction &fn, const int64_t push_slot)
+    {
+        m_fn = &fn;
+        m_push_slot = push_slot;
+        m_reg.assign(fn.insts.size(), no_reg);
+        m_block_at.assign(fn.blocks.size(), UINT32_MAX);
+        m_fixups.clear();
+        m_temp_count = 0;
+        count_uses();
+        alias_loads();
+        fold_stores();
+        for (IrBlockId id = 0; id < fn.blocks.size(); id++)
+        {
+            if (!fn.blocks[id].live)
+            {
+                continue;
+            }
+            m_block_at[id] = static_cast<uint32_t>(m_code.size());
+            for (uint32_t i = fn.blocks[id].begin; i < fn.blocks[id].end; i++)
+            {
+                lower_inst(id, i);
+            }
+        }
+        // every jump goes forward to a live block, placed by now
+        for (const auto &[at, block] : m_fixups)
+        {
+            assert(m_block_at[block] != UINT32_MAX);
+            m_code[at].a = m_block_at[block];
+        }
+        m_stats.temporaries = std::max(m_stats.temporaries, static_cast<size_t>(m_temp_count));
+    }
+
+    // ends the program with exit status 0 after the last statement and lays out the register file, temporaries
+    // first, then constants, then variables
+    [[nodiscard]] Bytecode finish()
+    {
+        m_code.push_back({BcOp::exit, constant(0)});
+        m_stats.constants = m_constants.size();
+        const auto temporaries = static_cast<uint32_t>(m_stats.temporaries);
+        const auto constants = static_cast<uint32_t>(m_constants.size());
+        const auto place = [&](uint32_t &reg)
+        {
+            const uint32_t index = reg & ~bank_mask;
+            reg = (reg & bank_mask) == temp_bank ? index : (reg & bank_mask) == constant_bank ? temporaries + index : temporaries + constants + index;
+        };
+        for (BcInst &inst : m_code)
+        {
+            switch (inst.op)
+            {
+            case BcOp::move:
+                place(inst.a);
+                place(inst.b);
+                break;
+            case BcOp::jmp:
+                break;
+            case BcOp::jz:
+            case BcOp::jnz:
+                place(inst.b);
+                break;
+            case BcOp::jeq:
+            case BcOp::jne:
+                place(inst.b);
+                place(inst.c);
+                break;
+            case BcOp::exit:
+                place(inst.a);
+                break;
+            default:
+                place(inst.a);
+                place(inst.b);
+                place(inst.c);
+            }
+        }
+        Bytecode bytecode{std::move(m_code), std::vector<uint64_t>(temporaries, 0)};
+        bytecode.registers.insert(bytecode.registers.end(), m_constant_values.begin(), m_constant_values.end());
+        bytecode.registers.resize(bytecode.registers.size() + m_stats.variables, 0);
+        return bytecode;
+    }
+
+    [[nodiscard]] const Stats &stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    // a register before finish() numbers it within the file, its bank and its index within the bank
+    static constexpr uint32_t temp_bank = 0;
+    static constexpr uint32_t constant_bank = 1u << 30;
+    static constexpr uint32_t slot_bank = 2u << 30;
+    static constexpr uint32_t bank_mask = 3u << 30;
+    static constexpr uint32_t no_reg = UINT32_MAX;
+
+    // how often and where last each value is read by the instructions of live blocks, and where the stores are
+    // a phi argument is taken to be read by the phi, which is no earlier than the move at the end of its predecessor
+    void count_uses()
+    {
+        const IrFunction &fn = *m_fn;
+        m_uses.assign(fn.insts.size(), 0);
+        m_last_use.assign(fn.insts.size(), 0);
+        m_stores.clear();
+        const auto use = [&](const IrValue value, const uint32_t at)
+        {
+            const IrValue v = fn.resolve(value);
+            m_uses[v]++;
+            m_last_use[v] = std::max(m_last_use[v], at);
+        };
+        for (const IrBlock &block : fn.blocks)
+        {
+            if (!block.live)
+            {
+                continue;
+            }
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                const IrInst &inst = fn.insts[i];
+                if (inst.op == IrOp::phi)
+                {
+                    const std::span<const IrValue> args = fn.args_of(inst, block);
+                    const std::span<const IrBlockId> preds = fn.preds_of(block);
+                    for (size_t k = 0; k < args.size(); k++)
+                    {
+                        if (fn.blocks[preds[k]].live)
+                        {
+                            use(args[k], i);
+                        }
+                    }
+                }
+                else if (inst.op != IrOp::copy)
+                {
+                    for (const uint32_t operand : {inst.a, inst.b})
+                    {
+                        if (operand != ir_none)
+                        {
+                            use(operand, i);
+                        }
+                    }
+                }
+                if (inst.op == IrOp::store)
+                {
+                    m_stores.emplace_back(i, inst.imm);
+                }
+            }
+        }
+    }
+
+    // a load reads the register of its variable when no store to the variable comes between it and its last use
+    // the jumps all go forward, so a store that comes later in the layout is never executed before the load
+    void alias_loads()
+    {
+        const IrFunction &fn = *m_fn;
+        m_alias_end.clear();
+        for (const IrBlock &block : fn.blocks)
+        {
+            if (!block.live)
+            {
+                continue;
+            }
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                const IrInst &inst = fn.insts[i];
+                if (inst.op != IrOp::load)
+                {
+                    continue;
+                }
+                bool stored = false;
+                auto store = std::upper_bound(m_stores.begin(), m_stores.end(), std::pair<uint32_t, int64_t>{i, INT64_MAX});
+                for (; store != m_stores.end() && store->first < m_last_use[i] && !stored; ++store)
+                {
+                    stored = store->second == inst.imm;
+                }
+                if (stored)
+                {
+                    continue;
+                }
+                m_reg[i] = slot(inst.imm);
+                m_stats.fused_loads++;
+                auto end = std::find_if(m_alias_end.begin(), m_alias_end.end(), [&](const auto &e)
+                                        { return e.first == inst.imm; });
+                if (end == m_alias_end.end())
+                {
+                    m_alias_end.emplace_back(inst.imm, m_last_use[i]);
+                }
+                else
+                {
+                    end->second = std::max(end->second, m_last_use[i]);
+                }
+            }
+        }
+    }
+
+    // an arithmetic value that is only stored to a variable is written to the variable by its own instruction when
+    // nothing reads or writes the variable in between, the loads reading its register included
+    void fold_stores()
+    {
+        const IrFunction &fn = *m_fn;
+        for (const IrBlock &block : fn.blocks)
+        {
+            if (!block.live)
+            {
+                continue;
+            }
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                const IrInst &inst = fn.insts[i];
+                if (inst.op != IrOp::store && inst.op != IrOp::push)
+                {
+                    continue;
+                }
+                const int64_t s = inst.op == IrOp::store ? inst.imm : m_push_slot;
+                const IrValue v = fn.resolve(inst.a);
+                const IrOp op = fn.insts[v].op;
+                if (op < IrOp::add || op > IrOp::urem || m_uses[v] != 1 || v < block.begin || m_reg[v] != no_reg)
+                {
+                    continue;
+                }
+                bool touched = false;
+                for (uint32_t q = v + 1; q < i && !touched; q++)
+                {
+                    touched = (fn.insts[q].op == IrOp::load || fn.insts[q].op == IrOp::store) && fn.insts[q].imm == s;
+                }
+                const auto end = std::find_if(m_alias_end.begin(), m_alias_end.end(), [&](const auto &e)
+                                              { return e.first == s; });
+                if (touched || (end != m_alias_end.end() && end->second > v))
+                {
+                    continue;
+                }
+                m_reg[v] = slot(s);
+                m_stats.fused_stores++;
+            }
+        }
+    }
+
+    void lower_inst(const IrBlockId id, const uint32_t i)
+    {
+        const IrFunction &fn = *m_fn;
+        const IrBlock &block = fn.blocks[id];
+        const IrInst &inst = fn.insts[i];
+        switch (inst.op)
+        {
+        case IrOp::constant:
+        case IrOp::lit:
+        case IrOp::phi:
+        case IrOp::copy:
+        case IrOp::nop:
+        case IrOp::ret:
+            // registers of their own, or no code
+            break;
+        case IrOp::load:
+            if (m_reg[i] == no_reg)
+            {
+                m_reg[i] = temp();
+                emit(BcOp::move, m_reg[i], slot(inst.imm));
+            }
+            break;
+        case IrOp::add:
+        case IrOp::sub:
+        case IrOp::mul:
+        case IrOp::udiv:
+        case IrOp::urem:
+        {
+            if (inst.op == IrOp::sub && fused_branch(block, i))
+            {
+                break;
+            }
+            const uint32_t a = reg(inst.a);
+            const uint32_t b = reg(inst.b);
+            if (m_reg[i] == no_reg)
+            {
+                m_reg[i] = reusable(inst.a) ? a : reusable(inst.b) ? b : temp();
+            }
+            const auto op = static_cast<BcOp>(static_cast<uint8_t>(BcOp::add) + (static_cast<uint8_t>(inst.op) - static_cast<uint8_t>(IrOp::add)));
+            emit(op, m_reg[i], a, b);
+            break;
+        }
+        case IrOp::store:
+        case IrOp::push:
+        {
+            const uint32_t dst = slot(inst.op == IrOp::store ? inst.imm : m_push_slot);
+            const uint32_t src = reg(inst.a);
+            if (src != dst)
+            {
+                emit(BcOp::move, dst, src);
+            }
+            break;
+        }
+        case IrOp::br:
+        {
+            // to succ[0] when the value is not 0, so when the operands of a fused sub differ
+            const IrValue v = fn.resolve(inst.a);
+            const bool fused = fused_branch(block, v);
+            const bool fall = next_live(id) == block.succ[0];
+            if (fused)
+            {
+                emit(fall ? BcOp::jeq : BcOp::jne, 0, reg(fn.insts[v].a), reg(fn.insts[v].b));
+                m_stats.fused_branches++;
+            }
+            else
+            {
+                emit(fall ? BcOp::jz : BcOp::jnz, 0, reg(v));
+            }
+            jump_to(fall ? block.succ[1] : block.succ[0]);
+            if (!fall && next_live(id) != block.succ[1])
+            {
+                emit(BcOp::jmp);
+                jump_to(block.succ[1]);
+            }
+            break;
+        }
+        case IrOp::jmp:
+        {
+            // the phis of the successor take their arguments for this edge
+            const IrBlock &target = fn.blocks[block.succ[0]];
+            const std::span<const IrBlockId> preds = fn.preds_of(target);
+            const auto k = static_cast<size_t>(std::find(preds.begin(), preds.end(), id) - preds.begin());
+            // folded and removed phis stay among the phis
+            for (uint32_t p = target.begin; p < target.end; p++)
+            {
+                const IrOp op = fn.insts[p].op;
+                if (op == IrOp::phi)
+                {
+                    emit(BcOp::move, reg(p), reg(fn.args_of(fn.insts[p], target)[k]));
+                }
+                else if (op != IrOp::copy && op != IrOp::constant && op != IrOp::nop)
+                {
+                    break;
+                }
+            }
+            if (next_live(id) != block.succ[0])
+            {
+                emit(BcOp::jmp);
+                jump_to(block.succ[0]);
+            }
+            break;
+        }
+        case IrOp::exit:
+            emit(BcOp::exit, reg(inst.a));
+            break;
+        }
+    }
+
+    // whether sub v is read only by the br ending its block with nothing but registers of their own or loads
+    // between them, so the br can compare its operands instead
+    [[nodiscard]] bool fused_branch(const IrBlock &block, const IrValue v) const
+    {
+        const IrFunction &fn = *m_fn;
+        const IrInst &last = fn.terminator(block);
+        if (fn.insts[v].op != IrOp::sub || last.op != IrOp::br || fn.resolve(last.a) != v || m_uses[v] != 1 || v < block.begin)
+        {
+            return false;
+        }
+        for (uint32_t q = v + 1; q < block.end - 1; q++)
+        {
+            const IrOp op = fn.insts[q].op;
+            if (op != IrOp::constant && op != IrOp::lit && op != IrOp::copy && op != IrOp::nop && op != IrOp::load)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // register of a value, constants and literals get theirs on first use and so do phis, from the first move into them
+    uint32_t reg(IrValue value)
+    {
+        value = m_fn->resolve(value);
+        if (m_reg[value] != no_reg)
+        {
+            return m_reg[value];
+        }
+        const IrInst &inst = m_fn->insts[value];
+        switch (inst.op)
+        {
+        case IrOp::constant:
+            m_reg[value] = constant(static_cast<uint64_t>(inst.imm));
+            break;
+        case IrOp::lit:
+            m_reg[value] = constant(literal(static_cast<uint32_t>(inst.imm)));
+            break;
+        default:
+            assert(inst.op == IrOp::phi);
+            m_reg[value] = temp();
+        }
+        return m_reg[value];
+    }
+
+    // whether the register of a value can be the result of the only instruction reading it
+    [[nodiscard]] bool reusable(IrValue value) const
+    {
+        value = m_fn->resolve(value);
+        return m_uses[value] == 1 && (m_reg[value] & bank_mask) == temp_bank;
+    }
+
+    // the value of a literal too long for a constant, an integer keeps its low 64 bits as in machine code
+    [[nodiscard]] uint64_t literal(const uint32_t id) const
+    {
+        const std::string_view text = m_strings.text(id);
+        uint64_t value = 0;
+        for (const char c : text)
+        {
+            if (c < '0' || c > '9')
+            {
+                std::cerr << "Literal has no bytecode value: " << text << std::endl;
+                fail();
+            }
+            value = value * 10 + static_cast<uint64_t>(c - '0');
+        }
+        return value;
+    }
+
+    uint32_t constant(const uint64_t value)
+    {
+        const auto [it, inserted] = m_constants.try_emplace(value, static_cast<uint32_t>(m_constants.size()));
+        if (inserted)
+        {
+            m_constant_values.push_back(value);
+        }
+        return constant_bank | it->second;
+    }
+
+    uint32_t slot(const int64_t s)
+    {
+        m_stats.variables = std::max(m_stats.variables, static_cast<size_t>(s) + 1);
+        return slot_bank | static_cast<uint32_t>(s);
+    }
+
+    uint32_t temp()
+    {
+        return temp_bank | m_temp_count++;
+    }
+
+    // first live block after block id
+    [[nodiscard]] IrBlockId next_live(IrBlockId id) const
+    {
+        do
+        {
+            id++;
+        } while (id < m_fn->blocks.size() && !m_fn->blocks[id].live);
+        return id;
+    }
+
+    void emit(const BcOp op, const uint32_t a = 0, const uint32_t b = 0, const uint32_t c = 0)
+    {
+        m_code.push_back({op, a, b, c});
+    }
+
+    // the last instruction jumps to a block, its position is filled in once the block is placed
+    void jump_to(const IrBlockId block)
+    {
+        m_fixups.emplace_back(static_cast<uint32_t>(m_code.size() - 1), block);
+    }
+
+    const StringTable &m_strings;
+    const IrFunction *m_fn = nullptr;
+    int64_t m_push_slot = 0;
+    uint32_t m_temp_count = 0;                                // temporaries of the statement
+    std::vector<BcInst> m_code{};
+    std::vector<uint32_t> m_reg{};                            // by value, its register
+    std::vector<uint32_t> m_uses{};                           // by value, how often live instructions read it
+    std::vector<uint32_t> m_last_use{};                       // by value, the last instruction reading it
+    std::vector<std::pair<uint32_t, int64_t>> m_stores{};     // stores in order and the slots they write
+    std::vector<std::pair<int64_t, uint32_t>> m_alias_end{};  // slots read by loads in place, the last use of those
+    std::vector<uint32_t> m_block_at{};                       // by block, the position of its code
+    std::vector<std::pair<uint32_t, IrBlockId>> m_fixups{};   // jumps and the blocks they go to
+    std::unordered_map<uint64_t, uint32_t> m_constants{};     // by value, index of the register holding it
+    std::vector<uint64_t> m_constant_values{};                // by index, the constant
+    Stats m_stats{};
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdlib>
+
+// thrown instead of exiting when compile errors are recoverable
+struct CompileError
+{
+};
+
+// whether a compile error ends the process (the default) or throws CompileError, watch mode keeps running after errors
+inline bool &throw_on_error()
+{
+    static bool enabled = false;
+    return enabled;
+}
+
+// called after a compile error has been reported
+[[noreturn]] inline void fail()
+{
+    if (throw_on_error())
+    {
+        throw CompileError{};
+    }
+    exit(EXIT_FAILURE);
+}
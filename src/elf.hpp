@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./encoder.hpp"
+
+// bytes of an ELF64 file for x86-64 as it is laid out
+class ElfImage
+{
+
+public:
+    // appends size bytes at the next multiple of align and returns their offset, zeros without data
+    size_t place(const void *data, const size_t size, const size_t align)
+    {
+        m_bytes.resize((m_bytes.size() + align - 1) / align * align, 0);
+        const size_t offset = m_bytes.size();
+        m_bytes.resize(offset + size, 0);
+        if (data != nullptr && size != 0)
+        {
+            std::memcpy(m_bytes.data() + offset, data, size);
+        }
+        return offset;
+    }
+
+    // the file header, placed first, with the fields every file has filled in
+    void place_header(const uint16_t type)
+    {
+        Elf64_Ehdr header{};
+        std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = ELFCLASS64;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = type;
+        header.e_machine = EM_X86_64;
+        header.e_version = EV_CURRENT;
+        header.e_ehsize = sizeof(Elf64_Ehdr);
+        header.e_shentsize = sizeof(Elf64_Shdr);
+        place(&header, sizeof(header), 1);
+    }
+
+    [[nodiscard]] Elf64_Ehdr &header()
+    {
+        return *reinterpret_cast<Elf64_Ehdr *>(m_bytes.data());
+    }
+
+    [[nodiscard]] std::vector<uint8_t> take()
+    {
+        return std::move(m_bytes);
+    }
+
+private:
+    std::vector<uint8_t> m_bytes{};
+};
+
+// writes machine code as an ELF64 relocatable object for x86-64 with the sections .text, .symtab, .strtab and
+// .shstrtab, the code needs no relocations, every jump in it is relative
+// the symbols are the labels as local symbols and _start at the start of the code as the only global one
+class ElfObjectWriter
+{
+
+public:
+    // the object file as bytes
+    [[nodiscard]] std::vector<uint8_t> write(const std::span<const uint8_t> code, const std::span<const X86Encoder::Label> labels)
+    {
+        m_strtab.assign(1, '\0');
+        std::vector<Elf64_Sym> symbols(1, Elf64_Sym{});
+        for (const X86Encoder::Label &label : labels)
+        {
+            symbols.push_back(symbol("label" + std::to_string(label.number), STB_LOCAL, label.offset));
+        }
+        const auto first_global = static_cast<uint32_t>(symbols.size());
+        symbols.push_back(symbol("_start", STB_GLOBAL, 0));
+
+        const std::string shstrtab = std::string("\0.text\0.symtab\0.strtab\0.shstrtab\0", 33);
+        ElfImage image;
+        image.place_header(ET_REL);
+        const size_t text = image.place(code.data(), code.size(), 16);
+        const size_t symtab = image.place(symbols.data(), symbols.size() * sizeof(Elf64_Sym), 8);
+        const size_t strtab = image.place(m_strtab.data(), m_strtab.size(), 1);
+        const size_t names = image.place(shstrtab.data(), shstrtab.size(), 1);
+
+        // section headers, indices as in section_index
+        std::vector<Elf64_Shdr> sections(5, Elf64_Shdr{});
+        sections[1] = {1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 0, text, code.size(), 0, 0, 16, 0};
+        sections[2] = {7, SHT_SYMTAB, 0, 0, symtab, symbols.size() * sizeof(Elf64_Sym), 3, first_global, 8, sizeof(Elf64_Sym)};
+        sections[3] = {15, SHT_STRTAB, 0, 0, strtab, m_strtab.size(), 0, 0, 1, 0};
+        sections[4] = {23, SHT_STRTAB, 0, 0, names, shstrtab.size(), 0, 0, 1, 0};
+        const size_t headers = image.place(sections.data(), sections.size() * sizeof(Elf64_Shdr), 8);
+
+        image.header().e_shoff = headers;
+        image.header().e_shnum = static_cast<uint16_t>(sections.size());
+        image.header().e_shstrndx = 4;
+        return image.take();
+    }
+
+    static constexpr uint16_t section_index = 1; // of .text
+
+private:
+    Elf64_Sym symbol(const std::string &name, const unsigned char bind, const uint64_t value)
+    {
+        Elf64_Sym sym{};
+        sym.st_name = static_cast<uint32_t>(m_strtab.size());
+        sym.st_info = ELF64_ST_INFO(bind, STT_NOTYPE);
+        sym.st_shndx = section_index;
+        sym.st_value = value;
+        m_strtab.append(name);
+        m_strtab.push_back('\0');
+        return sym;
+    }
+
+    std::string m_strtab{};
+};
+
+// links machine code into a static ELF64 executable for x86-64, in place of the system linker
+// the code needs nothing from other objects and has no data, so the file is one loadable segment, readable and
+// executable, holding the headers and the code, with _start at the first byte of the code
+// the sections .text and .shstrtab are only there for tools like objdump and gdb, they are not loaded
+class ElfExecutableWriter
+{
+
+public:
+    static constexpr uint64_t base_address = 0x400000; // where the segment is loaded, as ld places it
+
+    // the executable as bytes
+    [[nodiscard]] std::vector<uint8_t> write(const std::span<const uint8_t> code) const
+    {
+        ElfImage image;
+        image.place_header(ET_EXEC);
+        const size_t segment_header = image.place(nullptr, sizeof(Elf64_Phdr), 8);
+        const size_t text = image.place(code.data(), code.size(), 16);
+        const size_t segment_end = text + code.size();
+
+        const std::string shstrtab = std::string("\0.text\0.shstrtab\0", 17);
+        const size_t names = image.place(shstrtab.data(), shstrtab.size(), 1);
+        std::vector<Elf64_Shdr> sections(3, Elf64_Shdr{});
+        sections[1] = {1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, base_address + text, text, code.size(), 0, 0, 16, 0};
+        sections[2] = {7, SHT_STRTAB, 0, 0, names, shstrtab.size(), 0, 0, 1, 0};
+        const size_t headers = image.place(sections.data(), sections.size() * sizeof(Elf64_Shdr), 8);
+
+        Elf64_Ehdr &header = image.header();
+        header.e_entry = base_address + text;
+        header.e_phoff = segment_header;
+        header.e_phentsize = sizeof(Elf64_Phdr);
+        header.e_phnum = 1;
+        header.e_shoff = headers;
+        header.e_shnum = static_cast<uint16_t>(sections.size());
+        header.e_shstrndx = 2;
+        std::vector<uint8_t> bytes = image.take();
+        const Elf64_Phdr segment = {PT_LOAD, PF_R | PF_X, 0, base_address, base_address, segment_end, segment_end, 0x1000};
+        std::memcpy(bytes.data() + segment_header, &segment, sizeof(segment));
+        return bytes;
+    }
+};
+
+// writes bytes to a new file of the given mode, in place of any file of that name
+// the old file is unlinked rather than truncated, so a program still running from it is left alone
+inline void write_file(const char *path, const std::span<const uint8_t> bytes, const mode_t mode = 0644)
+{
+    unlink(path);
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    size_t written = 0;
+    while (fd >= 0 && written < bytes.size())
+    {
+        const ssize_t n = ::write(fd, bytes.data() + written, bytes.size() - written);
+        if (n <= 0)
+        {
+            break;
+        }
+        written += static_cast<size_t>(n);
+    }
+    if (fd < 0 || written != bytes.size() || close(fd) != 0)
+    {
+        std::cerr << "Unable to write file: " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
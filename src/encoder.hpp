@@ -0,0 +1,408 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "./diagnostics.hpp"
+#include "./machine.hpp"
+#include "./string_table.hpp"
+
+// encodes instructions into x86-64 machine code in memory, for the object file written in place of assembly text
+// registers and immediates are encoded in the shortest form the instruction has, jumps always take a 32-bit
+// displacement and are patched once the labels they go to are placed
+class X86Encoder
+{
+
+public:
+    // a label and the offset of the code it marks
+    struct Label
+    {
+        uint32_t number;
+        uint32_t offset;
+    };
+
+    // code of a top-level statement, from offset to the offset of the next region or the end of the code
+    struct Region
+    {
+        uint32_t statement; // 1-based, 0 for the implicit exit at the end of the program
+        uint32_t offset;
+    };
+
+    explicit X86Encoder(const StringTable &strings)
+        : m_strings(strings)
+    {
+    }
+
+    // a syscall becomes a call to the function at address with the syscall arguments rdi and rax as its own first
+    // two arguments, the function must not return
+    // for code run in the compiler's process, where the program ending must not end the compiler
+    void set_syscall_handler(const uint64_t address)
+    {
+        m_syscall_handler = address;
+    }
+
+    // the code encoded from now on is that of a top-level statement
+    void begin_statement(const uint32_t statement)
+    {
+        m_regions.push_back({statement, static_cast<uint32_t>(m_code.size())});
+    }
+
+    void encode(const Inst &inst)
+    {
+        switch (inst.op)
+        {
+        case Op::mov:
+            mov(inst.dst, inst.src);
+            break;
+        case Op::add:
+            alu(0, inst.dst, inst.src);
+            break;
+        case Op::sub:
+            alu(5, inst.dst, inst.src);
+            break;
+        case Op::and_:
+            alu(4, inst.dst, inst.src);
+            break;
+        case Op::xor_:
+            alu(6, inst.dst, inst.src);
+            break;
+        case Op::imul:
+        {
+            // imul r, r/m, or with an immediate the three operand form with the register as both
+            const Operand src = value(inst.src);
+            if (src.kind == Operand::Kind::imm)
+            {
+                encode({Op::imul3, inst.dst, inst.dst, src.value});
+                break;
+            }
+            modrm({0x0F, 0xAF}, reg_number(inst.dst), src);
+            break;
+        }
+        case Op::imul3:
+        {
+            const bool imm8 = inst.imm == static_cast<int8_t>(inst.imm);
+            modrm({imm8 ? uint8_t{0x6B} : uint8_t{0x69}}, reg_number(inst.dst), value(inst.src));
+            immediate(inst.imm, imm8 ? 1 : 4);
+            break;
+        }
+        case Op::mul:
+            modrm({0xF7}, 4, value(inst.dst));
+            break;
+        case Op::div:
+            modrm({0xF7}, 6, value(inst.dst));
+            break;
+        case Op::lea:
+            lea(inst);
+            break;
+        case Op::shl:
+        case Op::shr:
+        {
+            // by 1 has a form of its own
+            const uint8_t ext = inst.op == Op::shl ? 4 : 5;
+            const int64_t count = value(inst.src).value;
+            modrm({count == 1 ? uint8_t{0xD1} : uint8_t{0xC1}}, ext, value(inst.dst));
+            if (count != 1)
+            {
+                immediate(count, 1);
+            }
+            break;
+        }
+        case Op::test:
+            modrm({0x85}, reg_number(inst.src), value(inst.dst));
+            break;
+        case Op::push:
+            push(value(inst.dst));
+            break;
+        case Op::pop:
+            if (inst.dst.kind == Operand::Kind::reg)
+            {
+                short_reg(0x58, inst.dst.reg());
+            }
+            else
+            {
+                modrm({0x8F}, 0, inst.dst, false);
+            }
+            break;
+        case Op::jz:
+            m_code.insert(m_code.end(), {0x0F, 0x84});
+            jump_to(inst.dst);
+            break;
+        case Op::jmp:
+            m_code.push_back(0xE9);
+            jump_to(inst.dst);
+            break;
+        case Op::label:
+            m_labels.push_back({static_cast<uint32_t>(inst.dst.value), static_cast<uint32_t>(m_code.size())});
+            if (m_label_offsets.size() <= static_cast<size_t>(inst.dst.value))
+            {
+                m_label_offsets.resize(static_cast<size_t>(inst.dst.value) + 1, UINT32_MAX);
+            }
+            m_label_offsets[static_cast<size_t>(inst.dst.value)] = static_cast<uint32_t>(m_code.size());
+            break;
+        case Op::syscall:
+            if (m_syscall_handler == 0)
+            {
+                m_code.insert(m_code.end(), {0x0F, 0x05});
+                break;
+            }
+            // the handler never returns, so the stack can be aligned as calls need it at the cost of what it holds
+            mov(Operand::reg_of(Reg::rsi), Operand::reg_of(Reg::rax));
+            mov(Operand::reg_of(Reg::rax), Operand::imm_of(static_cast<int64_t>(m_syscall_handler)));
+            alu(4, Operand::reg_of(Reg::rsp), Operand::imm_of(-16));
+            m_code.insert(m_code.end(), {0xFF, 0xD0}); // call rax
+            break;
+        }
+    }
+
+    // appends the code of another encoder that has not been finished, as if it had been encoded here
+    // its jumps are patched by finish() along with these, so they may go to labels either encoder places
+    void append(const X86Encoder &part)
+    {
+        const auto base = static_cast<uint32_t>(m_code.size());
+        m_code.insert(m_code.end(), part.m_code.begin(), part.m_code.end());
+        for (const Label &label : part.m_labels)
+        {
+            m_labels.push_back({label.number, base + label.offset});
+            if (m_label_offsets.size() <= label.number)
+            {
+                m_label_offsets.resize(label.number + 1, UINT32_MAX);
+            }
+            m_label_offsets[label.number] = base + label.offset;
+        }
+        for (const Region &region : part.m_regions)
+        {
+            m_regions.push_back({region.statement, base + region.offset});
+        }
+        for (const auto &[at, label] : part.m_fixups)
+        {
+            m_fixups.emplace_back(base + at, label);
+        }
+    }
+
+    // patches the jumps, every label they go to must be placed by now
+    void finish()
+    {
+        for (const auto &[at, label] : m_fixups)
+        {
+            assert(label < m_label_offsets.size() && m_label_offsets[label] != UINT32_MAX);
+            const auto rel = static_cast<int32_t>(m_label_offsets[label] - (at + 4));
+            for (uint32_t i = 0; i < 4; i++)
+            {
+                m_code[at + i] = static_cast<uint8_t>(static_cast<uint32_t>(rel) >> (8 * i));
+            }
+        }
+        m_fixups.clear();
+    }
+
+    [[nodiscard]] const std::vector<uint8_t> &code() const
+    {
+        return m_code;
+    }
+
+    // labels in the order they were placed
+    [[nodiscard]] const std::vector<Label> &labels() const
+    {
+        return m_labels;
+    }
+
+    // regions in the order they were begun
+    [[nodiscard]] const std::vector<Region> &regions() const
+    {
+        return m_regions;
+    }
+
+private:
+    static uint8_t reg_number(const Operand &o)
+    {
+        assert(o.kind == Operand::Kind::reg);
+        return static_cast<uint8_t>(o.reg());
+    }
+
+    // an operand with literals turned into the immediates they stand for
+    // an integer literal too long for 64 bits keeps its low 64 bits, as assemblers do, a float has no encoding
+    [[nodiscard]] Operand value(const Operand &o) const
+    {
+        if (o.kind != Operand::Kind::lit)
+        {
+            return o;
+        }
+        const std::string_view text = m_strings.text(static_cast<uint32_t>(o.value));
+        uint64_t imm = 0;
+        for (const char c : text)
+        {
+            if (c < '0' || c > '9')
+            {
+                std::cerr << "Literal has no machine encoding: " << text << std::endl;
+                fail();
+            }
+            imm = imm * 10 + static_cast<uint64_t>(c - '0');
+        }
+        return Operand::imm_of(static_cast<int64_t>(imm));
+    }
+
+    void immediate(const int64_t imm, const int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+        {
+            m_code.push_back(static_cast<uint8_t>(static_cast<uint64_t>(imm) >> (8 * i)));
+        }
+    }
+
+    // opcode with a ModRM byte, reg is a register number or an opcode extension, rm a register or QWORD [rsp + d]
+    // wide instructions operate on 64 bits and take the REX.W prefix
+    void modrm(const std::initializer_list<uint8_t> opcode, const uint8_t reg, const Operand &rm, const bool wide = true)
+    {
+        const bool mem = rm.kind == Operand::Kind::mem;
+        assert(mem || rm.kind == Operand::Kind::reg);
+        const uint8_t base = mem ? static_cast<uint8_t>(Reg::rsp) : static_cast<uint8_t>(rm.reg());
+        const uint8_t rex = (wide ? 0x48 : 0x40) | ((reg & 8) != 0 ? 0x04 : 0) | ((base & 8) != 0 ? 0x01 : 0);
+        if (rex != 0x40)
+        {
+            m_code.push_back(rex);
+        }
+        m_code.insert(m_code.end(), opcode);
+        if (!mem)
+        {
+            m_code.push_back(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (base & 7)));
+            return;
+        }
+        // rsp as a base takes a SIB byte, with no index
+        const int64_t disp = rm.value;
+        const uint8_t mod = disp == 0 ? 0x00 : disp == static_cast<int8_t>(disp) ? 0x40 : 0x80;
+        m_code.push_back(static_cast<uint8_t>(mod | ((reg & 7) << 3) | 0x04));
+        m_code.push_back(0x24);
+        if (mod != 0x00)
+        {
+            immediate(disp, mod == 0x40 ? 1 : 4);
+        }
+    }
+
+    // instruction with the register in the low bits of its opcode
+    void short_reg(const uint8_t opcode, const Reg reg)
+    {
+        if ((static_cast<uint8_t>(reg) & 8) != 0)
+        {
+            m_code.push_back(0x41);
+        }
+        m_code.push_back(static_cast<uint8_t>(opcode + (static_cast<uint8_t>(reg) & 7)));
+    }
+
+    void mov(const Operand &dst, const Operand &src_operand)
+    {
+        const Operand src = value(src_operand);
+        if (src.kind == Operand::Kind::imm)
+        {
+            const int64_t imm = src.value;
+            if (dst.kind == Operand::Kind::reg && imm == static_cast<uint32_t>(imm))
+            {
+                // writing 32 bits clears the upper half
+                short_reg(0xB8, dst.reg());
+                immediate(imm, 4);
+            }
+            else if (imm == static_cast<int32_t>(imm))
+            {
+                modrm({0xC7}, 0, dst);
+                immediate(imm, 4);
+            }
+            else
+            {
+                assert(dst.kind == Operand::Kind::reg);
+                m_code.push_back((static_cast<uint8_t>(dst.reg()) & 8) != 0 ? 0x49 : 0x48);
+                m_code.push_back(static_cast<uint8_t>(0xB8 + (static_cast<uint8_t>(dst.reg()) & 7)));
+                immediate(imm, 8);
+            }
+            return;
+        }
+        if (src.kind == Operand::Kind::reg)
+        {
+            modrm({0x89}, reg_number(src), dst);
+            return;
+        }
+        modrm({0x8B}, reg_number(dst), src);
+    }
+
+    // add, sub, and, xor, ext is the opcode extension of the immediate forms and the opcode of the others is
+    // ext * 8 + 1 with a register source, + 3 with a memory source
+    void alu(const uint8_t ext, const Operand &dst, const Operand &src_operand)
+    {
+        const Operand src = value(src_operand);
+        if (src.kind == Operand::Kind::imm)
+        {
+            const bool imm8 = src.value == static_cast<int8_t>(src.value);
+            modrm({imm8 ? uint8_t{0x83} : uint8_t{0x81}}, ext, dst);
+            immediate(src.value, imm8 ? 1 : 4);
+            return;
+        }
+        if (src.kind == Operand::Kind::reg)
+        {
+            modrm({static_cast<uint8_t>(ext * 8 + 1)}, reg_number(src), dst);
+            return;
+        }
+        modrm({static_cast<uint8_t>(ext * 8 + 3)}, reg_number(dst), src);
+    }
+
+    // lea dst, [src + src * imm], with src as both base and index of a SIB byte
+    void lea(const Inst &inst)
+    {
+        const uint8_t dst = reg_number(inst.dst);
+        const uint8_t src = reg_number(inst.src);
+        const uint8_t scale = inst.imm == 1 ? 0 : inst.imm == 2 ? 1 : inst.imm == 4 ? 2 : 3;
+        m_code.push_back(static_cast<uint8_t>(0x48 | ((dst & 8) != 0 ? 0x04 : 0) | ((src & 8) != 0 ? 0x03 : 0)));
+        m_code.push_back(0x8D);
+        // rbp and r13 as a base without a displacement would mean no base, they take a displacement of 0
+        const bool disp = (src & 7) == 5;
+        m_code.push_back(static_cast<uint8_t>((disp ? 0x40 : 0x00) | ((dst & 7) << 3) | 0x04));
+        m_code.push_back(static_cast<uint8_t>((scale << 6) | ((src & 7) << 3) | (src & 7)));
+        if (disp)
+        {
+            m_code.push_back(0);
+        }
+    }
+
+    void push(const Operand &o)
+    {
+        switch (o.kind)
+        {
+        case Operand::Kind::reg:
+            short_reg(0x50, o.reg());
+            break;
+        case Operand::Kind::imm:
+            // sign extended to 64 bits
+            if (o.value == static_cast<int8_t>(o.value))
+            {
+                m_code.push_back(0x6A);
+                immediate(o.value, 1);
+            }
+            else
+            {
+                assert(o.value == static_cast<int32_t>(o.value));
+                m_code.push_back(0x68);
+                immediate(o.value, 4);
+            }
+            break;
+        default:
+            modrm({0xFF}, 6, o, false);
+            break;
+        }
+    }
+
+    // 32-bit displacement to a label, patched by finish()
+    void jump_to(const Operand &label)
+    {
+        m_fixups.emplace_back(static_cast<uint32_t>(m_code.size()), static_cast<uint32_t>(label.value));
+        immediate(0, 4);
+    }
+
+    const StringTable &m_strings;
+    std::vector<uint8_t> m_code{};
+    std::vector<Label> m_labels{};
+    std::vector<Region> m_regions{};
+    std::vector<uint32_t> m_label_offsets{};                 // by label number, offset of the code it marks
+    std::vector<std::pair<uint32_t, uint32_t>> m_fixups{}; // offsets of jump displacements and their labels
+    uint64_t m_syscall_handler = 0;                        // see set_syscall_handler()
+};
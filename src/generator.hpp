@@ -1,155 +1,162 @@
 #pragma once
 
-#include <sstream>
 #include <cassert>
 #include <algorithm>
+#include <charconv>
 
+#include "./asm_writer.hpp"
+#include "./bytecode.hpp"
+#include "./encoder.hpp"
+#include "./ir.hpp"
+#include "./ir_opt.hpp"
+#include "./isel.hpp"
+#include "./machine.hpp"
 #include "./parser.hpp"
+#include "./peephole.hpp"
+#include "./regalloc.hpp"
 
+// each top-level statement is lowered to IR, the IR is optimized, instructions on virtual registers are selected from
+// it, then registers are allocated, the peephole rules are applied and the code is written out, so a statement is the
+// unit of all of these
+// variables local to a scope are IR values, variables declared at the top level live on the stack, where the
+// statements after the one declaring them find them
 class Generator
 {
 
 public:
-    // takes parsed tree as argument
-    explicit Generator(NodeProg prog)
-        : m_prog(std::move(prog))
+    // takes parsed tree and the string table holding the text of its identifiers and literals as arguments
+    // the code is streamed to fd as it is generated, or collected for take_output() without one
+    explicit Generator(NodeProg prog, const StringTable &strings, const int fd = -1)
+        : m_prog(std::move(prog)), m_strings(strings), m_output(fd)
     {
     }
 
-    void gen_term(const NodeTerm *term)
+    // IR value of the expression
+    IrValue gen_expr(const ExprRef expr)
     {
-        struct TermVisitor
-        {
-            Generator &gen;
-            void operator()(const NodeTermIntLit *term_int_lit) const
-            {
-                // if a term is integer literal, move the value to rax register and push onto stack
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-                gen.m_var_byte_size = 4;
-            }
+        return gen_expr(expr.pool, expr.root);
+    }
 
-            void operator()(const NodeTermCharLit *term_char_lit) const
+    // walks the expression with an explicit stack, so nesting depth is not limited by the call stack
+    // an operation is visited twice, first to schedule its operands and then to apply it to their values
+    // the operand that is not a leaf goes first, so chains like a + b + c hold two values at a time whichever way
+    // they lean
+    IrValue gen_expr(const NodeExpr *pool, const ExprId id)
+    {
+        const size_t base = m_expr_stack.size();
+        m_expr_stack.push_back({id, ExprStep::schedule});
+        while (m_expr_stack.size() > base)
+        {
+            const auto [at, step] = m_expr_stack.back();
+            m_expr_stack.pop_back();
+            const NodeExpr &expr = pool[at];
+            if (is_leaf(expr.op))
             {
-                gen.m_output << "    mov rax, " << term_char_lit->char_lit.value.value() << "\n";
-                gen.push("rax");
-                gen.m_var_byte_size = 1;
+                m_values.push_back(gen_term(expr));
             }
-
-            
-            void operator()(const NodeTermFloatLit *term_float_lit) const
+            else if (step == ExprStep::schedule)
             {
-                gen.m_output << "    mov rax, " << term_float_lit->float_lit.value.value() << "\n";
-                gen.push("rax");
-                gen.m_var_byte_size = 8;
+                const bool rhs_first = is_leaf(pool[expr.lhs].op) && !is_leaf(pool[expr.rhs].op);
+                m_expr_stack.push_back({at, rhs_first ? ExprStep::apply_rhs_first : ExprStep::apply});
+                m_expr_stack.push_back({rhs_first ? expr.lhs : expr.rhs, ExprStep::schedule});
+                m_expr_stack.push_back({rhs_first ? expr.rhs : expr.lhs, ExprStep::schedule});
             }
-
-            void operator()(const NodeTermIdent *term_ident) const
+            else
             {
-                // if a term is an identifier, search the list of identifiers in m_vars in reverse
-                // by searching in reverse order, it finds the identifier in local scope and then global scope
-                const auto it = std::find_if(gen.m_vars.rbegin(), gen.m_vars.rend(), [&](const Var &var)
-                                             { return var.name == term_ident->ident.value.value(); });
-                if (it == gen.m_vars.rend())
+                IrValue second = m_values.back();
+                m_values.pop_back();
+                IrValue first = m_values.back();
+                if (step == ExprStep::apply_rhs_first)
                 {
-                    std::cerr << "Undeclared identifier: " << term_ident->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    std::swap(first, second);
                 }
-                // pushing (copy) the value of identifier on top of the stack
-                // its location is found by -> total stack size - location of identifier
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size - it->stack_loc) * 8 << "]";
-                gen.push(offset.str());
+                m_values.back() = gen_bin_expr(expr, first, second);
             }
-            void operator()(const NodeTermParen *term_paren) const
-            {
-                // if a term is an expression, parse the expression
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-        TermVisitor visitor{.gen = *this};
-        std::visit(visitor, term->var);
+        }
+        const IrValue value = m_values.back();
+        m_values.pop_back();
+        return value;
     }
 
-    void gen_bin_expr(const NodeBinExpr *bin_expr)
+    // literals are constants, a local variable is the value it holds, a top-level one is loaded unless it is a
+    // constant
+    IrValue gen_term(const NodeExpr &expr)
     {
-        struct BinExprVisitor
+        switch (expr.op)
         {
-            Generator &gen;
-            // lhs and rhs of binary expression is an expression, so generate it
-            // lhs of binary expression is at the top of the stack
-            // rhs of binary expression is at one below top of the stack
-            // popping the values onto registers, perform operations and store onto top of the stack
-            void operator()(const NodeBinExprAdd *bin_expr_add) const
-            {
-                gen.gen_expr(bin_expr_add->rhs);
-                gen.gen_expr(bin_expr_add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeBinExprSub *bin_expr_sub) const
+        case ExprOp::int_lit:
+        {
+            // a literal that fits in 64 bits is a constant, a longer one is left to the assembler as written
+            const std::string_view text = m_strings.text(expr.lhs);
+            uint64_t imm = 0;
+            const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), imm);
+            m_var_byte_size = 4;
+            if (ec == std::errc{} && end == text.data() + text.size())
             {
-                gen.gen_expr(bin_expr_sub->rhs);
-                gen.gen_expr(bin_expr_sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
+                return constant(static_cast<int64_t>(imm));
             }
-            void operator()(const NodeBinExprMul *bin_expr_mul) const
+            return m_ir.add({IrOp::lit, IrType::i64, ir_none, ir_none, expr.lhs});
+        }
+        case ExprOp::char_lit:
+        {
+            // the token views the quoted character, its code is the value ('' is 0)
+            const std::string_view chr = m_strings.text(expr.lhs);
+            m_var_byte_size = 1;
+            return constant(chr.empty() ? 0 : static_cast<int>(chr.front()));
+        }
+        case ExprOp::float_lit:
+            m_var_byte_size = 8;
+            return m_ir.add({IrOp::lit, IrType::i64, ir_none, ir_none, expr.lhs});
+        case ExprOp::ident:
+        {
+            // if a term is an identifier, find the innermost variable of that name, local scope before global scope
+            const Var *var = lookup(expr.lhs);
+            if (var == nullptr)
             {
-                gen.gen_expr(bin_expr_mul->rhs);
-                gen.gen_expr(bin_expr_mul->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n"; // unsigned multiplication - rax = rax * rbx
-                gen.push("rax");
+                std::cerr << "Undeclared identifier: " << m_strings.text(expr.lhs) << std::endl;
+                fail();
             }
-            void operator()(const NodeBinExprDiv *bin_expr_div) const
+            if (var->current != ir_none)
             {
-                gen.gen_expr(bin_expr_div->rhs);
-                gen.gen_expr(bin_expr_div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n"; // unsigned division - rax = rax / rbx
-                gen.push("rax");
+                return var->current;
             }
-            void operator()(const NodeBinExprMod *bin_expr_mod) const
+            if (var->constant)
             {
-                gen.gen_expr(bin_expr_mod->rhs);
-                gen.gen_expr(bin_expr_mod->lhs);
-                gen.m_output << "    xor rdx, rdx\n"; // setting rdx to 0
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    div rbx\n"; // on division of rax / rbx, the remainder is stored in rdx
-                gen.m_output << "    mov rax, rdx\n";
-                gen.push("rax");
+                return constant(var->value);
             }
-        };
-        BinExprVisitor visitor{.gen = *this};
-        std::visit(visitor, bin_expr->var);
+            return m_ir.add({IrOp::load, IrType::i64, ir_none, ir_none, static_cast<int64_t>(var->stack_loc)});
+        }
+        default:
+            assert(false);
+            return ir_none;
+        }
     }
 
-    void gen_expr(const NodeExpr *expr)
+    // applies the operation to the values of its operands
+    IrValue gen_bin_expr(const NodeExpr &expr, const IrValue lhs, const IrValue rhs)
     {
-        struct ExprVisitor
+        IrOp op = IrOp::add;
+        switch (expr.op)
         {
-            Generator &gen;
-            void operator()(const NodeTerm *term) const
-            {
-                // if the expression is a term, generate the term
-                gen.gen_term(term);
-            }
-            void operator()(const NodeBinExpr *bin_expr) const
-            {
-                // if the expression is a binary expression, generate the binary expression
-                gen.gen_bin_expr(bin_expr);
-            }
-        };
-        ExprVisitor visitor{.gen = *this};
-        std::visit(visitor, expr->var);
+        case ExprOp::add:
+            op = IrOp::add;
+            break;
+        case ExprOp::sub:
+            op = IrOp::sub;
+            break;
+        case ExprOp::mul:
+            op = IrOp::mul;
+            break;
+        case ExprOp::div:
+            op = IrOp::udiv;
+            break;
+        case ExprOp::mod:
+            op = IrOp::urem;
+            break;
+        default:
+            assert(false);
+        }
+        return m_ir.add({op, IrType::i64, lhs, rhs});
     }
 
     void gen_scope(const NodeScope *scope)
@@ -158,71 +165,169 @@ public:
         begin_scope();
         for (const NodeStmt *stmt : scope->stmts)
         {
-            gen_stmt(stmt);
+            gen_nested_stmt(stmt);
         }
         end_scope();
     }
 
-    void gen_if_pred(const NodeIfPred *if_pred, const std::string &end_label)
+    // an if and its elif chain are generated in a loop, every branch is a block of its own ending in a jump to the
+    // block after the statement, where local variables the branches left with different values get a phi
+    // without an else there is still an empty else block, so a block that branches two ways has no successor that
+    // other blocks jump to as well
+    void gen_if(const NodeStmtIf *stmt_if)
     {
-        struct IfPredVisitor
+        const IfBranches branches{.vars = m_vars.size(), .log = m_assign_log.size(), .edges = m_edges.size(), .changes = m_changes.size()};
+        uint32_t count = 0;
+        Edge otherwise = gen_branch(stmt_if->expr, stmt_if->scope, branches, count);
+        std::optional<NodeIfPred *> next = stmt_if->pred;
+        while (true)
         {
-            Generator &gen;
-            const std::string &end_label;
-            void operator()(const NodeIfPredElif *if_pred_elif) const
+            start_block({&otherwise, 1});
+            if (!next.has_value())
+            {
+                end_branch(branches, count);
+                break;
+            }
+            if (const auto *elif = std::get_if<NodeIfPredElif *>(&next.value()->var))
+            {
+                otherwise = gen_branch((*elif)->expr, (*elif)->scope, branches, count);
+                next = (*elif)->pred;
+                continue;
+            }
+            gen_scope(std::get<NodeIfPredElse *>(next.value()->var)->scope);
+            end_branch(branches, count);
+            break;
+        }
+        start_block(std::span<const Edge>(m_edges).subspan(branches.edges));
+        m_edges.resize(branches.edges);
+        join(branches, count);
+    }
+
+    // generates a top-level statement and writes out its code
+    // following are up to look_ahead statements that come after it, stores they make dead are removed
+    // the statements after one that always exits are never reached, they are checked but no code is written for them
+    void gen_stmt(const NodeStmt *stmt, const std::span<const NodeStmt *const> following = {})
+    {
+        assert(m_scopes.empty());
+        m_stmt_count++;
+        m_following = following;
+        m_ir.clear();
+        m_assign_log.clear();
+        start_block({});
+        gen_nested_stmt(stmt);
+        m_ir.add({IrOp::ret});
+        assert(verify_ir(m_ir));
+        m_optimizer.fold(m_ir);
+        const bool push = m_ir.insts.size() >= 2 && m_ir.insts[m_ir.insts.size() - 2].op == IrOp::push;
+        bool slot = false;
+        if (push)
+        {
+            // a top-level variable declared with a constant that no statement assigns is that constant from now on
+            IrInst &inst = m_ir.insts[m_ir.insts.size() - 2];
+            const IrInst &value = m_ir.insts[inst.a];
+            Var &var = m_vars.back();
+            var.constant = value.op == IrOp::constant && !assigned(var.name);
+            var.value = var.constant ? value.imm : 0;
+            // it needs no stack slot then, nor when no statement reads it
+            slot = !m_unreachable && !var.constant && read(var.name);
+            if (!slot)
             {
-                gen.gen_expr(if_pred_elif->expr);       // generate expression for elif and now is at top of stack
-                std::string label = gen.create_label(); // same procedure as of if stmt
-                gen.pop("rax");
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(if_pred_elif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << label << ":\n";
-                if (if_pred_elif->pred.has_value()) // if elif is followed by other elif or else, generate it
+                if (m_dce_report != nullptr && !m_unreachable)
                 {
-                    gen.gen_if_pred(if_pred_elif->pred.value(), end_label);
+                    report() << "let " << m_strings.text(var.name) << " needs no stack slot, "
+                             << (var.constant ? "it is a constant" : "it is never read") << std::endl;
                 }
+                var.stack_loc = 0;
+                inst = {IrOp::nop};
+                m_dce.slots++;
             }
-            void operator()(const NodeIfPredElse *if_pred_else) const
+        }
+        if (m_unreachable)
+        {
+            if (m_dce_report != nullptr)
             {
-                gen.gen_scope(if_pred_else->scope); // for else, only generate the stmt, end label and others is taken care of by its if
+                report() << "never reached, an earlier statement always exits" << std::endl;
             }
-        };
-        IfPredVisitor visitor{.gen = *this, .end_label = end_label};
-        std::visit(visitor, if_pred->var);
+            m_dce.unreachable++;
+            return;
+        }
+        m_optimizer.eliminate(m_ir, dead_at_end());
+        assert(verify_ir(m_ir));
+        if (m_dce_report != nullptr)
+        {
+            report_removed();
+        }
+        m_unreachable = !m_ir.blocks.back().live;
+        if (m_ir_output != nullptr)
+        {
+            *m_ir_output << "; statement " << m_stmt_count << "\n";
+            write_ir(*m_ir_output, m_ir, m_strings);
+        }
+        if (m_bytecode != nullptr)
+        {
+            m_bytecode->lower(m_ir, static_cast<int64_t>(m_stack_size) + 1);
+            m_stack_size += slot ? 1 : 0;
+            return;
+        }
+        m_insts.clear();
+        const uint32_t vreg_count = m_selector.select(m_ir, label_count, m_insts);
+        m_allocated.clear();
+        m_allocator.allocate(m_insts, vreg_count, m_stack_size, m_allocated);
+        if (slot)
+        {
+            // a top-level variable is pushed once the spill slots of its statement are released
+            m_allocated.push_back({Op::push, Operand::reg_of(Reg::rax)});
+            m_stack_size++;
+        }
+        m_optimized.clear();
+        m_peephole.run(m_allocated, m_optimized);
+        if (m_encoder != nullptr)
+        {
+            m_encoder->begin_statement(static_cast<uint32_t>(m_stmt_count));
+        }
+        for (const Inst &inst : m_optimized)
+        {
+            emit(inst);
+        }
     }
 
-    void gen_stmt(const NodeStmt *stmt)
+    void gen_nested_stmt(const NodeStmt *stmt)
     {
         struct StmtVisitor
         {
             Generator &gen;
             void operator()(const NodeStmtExit *stmt_exit) const
             {
-                gen.gen_expr(stmt_exit->expr);       // generate the expression in exit function
-                gen.m_output << "    mov rax, 60\n"; // code 60 for exit in rax
-                gen.pop("rdi");                      // value to be returned in rdi
-                gen.m_output << "    syscall\n";
+                const IrValue value = gen.gen_expr(stmt_exit->expr); // generate the expression in exit function
+                gen.m_ir.add({IrOp::exit, IrType::none, value});
+                // what follows in the same scope is never reached, it goes into a block nothing jumps to
+                gen.start_block({});
             }
             void operator()(const NodeStmtLet *stmt_let) const
             {
-                // generate the expression to be stored and now it is at top of stack
-                gen.gen_expr(stmt_let->expr);
-                // calculating offset to find if an identifier with same name already exists in the same scope
-                //  offset = total no. of identifiers before the start of current scope
-                const int offset = gen.m_scopes.empty() ? 0 : gen.m_scopes.back();
-                // then searching for the identifier from the start of current scope and to the last
-                auto it = std::find_if(gen.m_vars.cbegin() + offset, gen.m_vars.cend(), [&](const Var &var)
-                                       { return var.name == stmt_let->ident.value.value(); });
-                if (it != gen.m_vars.cend())
+                // generate the expression to be stored
+                const IrValue value = gen.gen_expr(stmt_let->expr);
+                // an identifier with same name already exists in the same scope if the innermost variable of that name
+                // comes after the start of the current scope, variables of enclosing scopes may be shadowed
+                const size_t offset = gen.m_scopes.empty() ? 0 : gen.m_scopes.back();
+                const Var *var = gen.lookup(stmt_let->ident.value);
+                if (var != nullptr && static_cast<size_t>(var - gen.m_vars.data()) >= offset)
                 {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    std::cerr << "Identifier already used: " << gen.text(stmt_let->ident) << std::endl;
+                    fail();
                 }
 
-                // storing the name of the identifier and its location in stack (currently top) in m_vars
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size, .byte_size = gen.m_var_byte_size});
+                if (gen.m_scopes.empty())
+                {
+                    // a top-level variable is pushed and stays at its location in stack (the top after the push)
+                    gen.m_ir.add({IrOp::push, IrType::none, value});
+                    gen.declare({.name = stmt_let->ident.value, .stack_loc = gen.m_stack_size + 1, .byte_size = gen.m_var_byte_size});
+                }
+                else
+                {
+                    // a local variable is the value it holds, until the end of its scope
+                    gen.declare({.name = stmt_let->ident.value, .stack_loc = 0, .byte_size = gen.m_var_byte_size, .current = value});
+                }
                 gen.m_var_byte_size = 0;
             }
             void operator()(const NodeScope *scope) const
@@ -231,48 +336,40 @@ public:
             }
             void operator()(const NodeStmtIf *stmt_if) const
             {
-                gen.gen_expr(stmt_if->expr); // generate the expression to be checked and now is at top of stack
-                std::string end_label{};     // if if-statement has else or elif followed, creates the end label
-                if (stmt_if->pred.has_value())
+                gen.gen_if(stmt_if);
+            }
+            void operator()(const NodeStmtAssign *stmt_assign) const
+            {
+                const IrValue value = gen.gen_expr(stmt_assign->expr); // generate the expression to be assigned
+                // the innermost variable of that name, local scope before global scope
+                const Var *var = gen.lookup(stmt_assign->ident.value);
+                if (var == nullptr)
                 {
-                    end_label = gen.create_label();
+                    std::cerr << "Undeclared identifier: " << gen.text(stmt_assign->ident) << std::endl;
+                    fail();
                 }
-                std::string label = gen.create_label();
-                gen.pop("rax");
-                gen.m_output << "    test rax, rax\n";      // test performs and of two operands and if it is 0, it sets the zero flag to 1 otherwise 0
-                gen.m_output << "    jz " << label << "\n"; // jz - jumps to the label if previous command resulted in zero flag being set othewise not (i.e: condition is false)
-                gen.gen_scope(stmt_if->scope);              // generate the if-scope - stmts to be executed if condition is true
-                if (stmt_if->pred.has_value())              // if else or elif present
+                if (var->current != ir_none)
                 {
-                    gen.m_output << "    jmp " << end_label << "\n";   // if if-condition is true, jump to end label
-                    gen.m_output << label << ":\n";                    // label for following else or elif, if if-condition is false, this is executed
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label); // generate else or elif block
-                    gen.m_output << end_label << ":\n";                // if else of elif is true, jump to end label
+                    gen.assign(static_cast<size_t>(var - gen.m_vars.data()), value);
                 }
-                else
+                else if (var->stack_loc == 0)
                 {
-                    gen.m_output << label << ":\n"; // only if is present, one label is put on end of if
+                    // a top-level variable without a stack slot is never read, the value is not stored
+                    if (gen.m_dce_report != nullptr && !gen.m_unreachable)
+                    {
+                        gen.report() << "assignment to " << gen.text(stmt_assign->ident) << " removed, it is never read" << std::endl;
+                    }
                 }
-            }
-            void operator()(const NodeStmtAssign *stmt_assign) const
-            {
-                gen.gen_expr(stmt_assign->expr); // generate the expression to be assigned and is now at the top of stack
-                // search for the identifier in reverse order to find the identifier in local scope and then global scope
-                auto it = std::find_if(gen.m_vars.rbegin(), gen.m_vars.rend(), [&](const Var &var)
-                                       { return var.name == stmt_assign->ident.value.value(); });
-                if (it == gen.m_vars.rend())
+                else
                 {
-                    std::cerr << "Undeclared identifier: " << stmt_assign->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+                    gen.m_ir.add({IrOp::store, IrType::none, value, ir_none, static_cast<int64_t>(var->stack_loc)}); // store the value into the stack slot of the identifier
                 }
-                gen.pop("rax");                                                                            // store the expression at rax
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc) * 8 << "], rax\n"; // find the location of the identifier at stack and store the expression at rax into it
             }
             void operator()(const NodeFunction *function) const
             {
                 // auto function_label = gen.create_label();
                 // gen.m_output << "    jmp " << function_label << "\n";
-                // gen.m_output << function->function_name->ident.value.value() << ":\n";
+                // gen.m_output << gen.text(function->function_name->ident) << ":\n";
                 // gen.gen_scope(function->scope);
                 // gen.m_output << "    ret\n";
                 // gen.m_output << function_label << ":\n";
@@ -281,8 +378,8 @@ public:
             void operator()(const NodeFunctionCall *function_call) const
             {
                 assert(false);
-                // gen.m_output << "    call " << function_call->function_name->ident.value.value() << "\n";
-    
+                // gen.m_output << "    call " << gen.text(function_call->function_name->ident) << "\n";
+
             }
             void operator()(const NodeStmtPrint *stmt_print) const
             {
@@ -308,40 +405,553 @@ public:
                 // gen.m_output << "    int 0x80\n";
                 // gen.m_bss << "section .bss\n";
                 // gen.m_bss << "    buffer resd 1\n";
-                
+
             }
         };
         StmtVisitor visitor{.gen = *this};
         std::visit(visitor, stmt->var);
     }
 
-    std::string gen_prog()
+    // generates the whole program, when streaming it is all written out on return
+    void gen_prog()
     {
-        m_output << "global _start\n_start:\n"; //_start or main of the program
+        std::vector<uint32_t> names;
         for (const NodeStmt *stmt : m_prog.stmts)
         {
-            gen_stmt(stmt); // generate each statement
+            collect_assigned(stmt, names);
+        }
+        set_assigned(names);
+        names.clear();
+        for (const NodeStmt *stmt : m_prog.stmts)
+        {
+            collect_read(stmt, names);
+        }
+        set_read(names);
+        gen_prologue();
+        for (size_t i = 0; i < m_prog.stmts.size(); i++)
+        {
+            // generate each statement
+            gen_stmt(m_prog.stmts[i], m_prog.stmts.subspan(i + 1, std::min(look_ahead, m_prog.stmts.size() - i - 1)));
+        }
+        if (!m_unreachable)
+        {
+            gen_epilogue();
+        }
+        else if (writes_text())
+        {
+            m_output << m_bss.take();
+        }
+        m_output.flush();
+    }
+
+    void gen_prologue()
+    {
+        if (writes_text())
+        {
+            m_output << "global _start\n_start:\n"; //_start or main of the program
+        }
+    }
+
+    void gen_epilogue()
+    {
+        // implicit exit with 0 after successful completion of program, the bytecode ends with one of its own
+        if (m_bytecode != nullptr)
+        {
+            return;
+        }
+        if (m_encoder != nullptr)
+        {
+            m_encoder->begin_statement(0);
+        }
+        emit({Op::mov, Operand::reg_of(Reg::rax), Operand::imm_of(60)});
+        emit({Op::mov, Operand::reg_of(Reg::rdi), Operand::imm_of(0)});
+        emit({Op::syscall});
+        if (writes_text())
+        {
+            m_output << m_bss.take();
+        }
+    }
+
+    // the code goes to encoder as machine code instead of to the output as assembly, _start is its first byte
+    void set_encoder(X86Encoder *encoder)
+    {
+        m_encoder = encoder;
+    }
+
+    // the IR of each statement goes to compiler to be lowered to bytecode instead of machine code
+    void set_bytecode(BytecodeCompiler *compiler)
+    {
+        m_bytecode = compiler;
+    }
+
+    // adds the names of the variables stmt assigns to, nested statements included, to names
+    void collect_assigned(const NodeStmt *stmt, std::vector<uint32_t> &names)
+    {
+        visit_stmts(stmt, [&](const NodeStmt *next)
+                    {
+                        if (const auto *assign = std::get_if<NodeStmtAssign *>(&next->var))
+                        {
+                            names.push_back((*assign)->ident.value);
+                        } });
+    }
+
+    // adds the names of the identifiers the expressions of stmt read, nested statements included, to names
+    void collect_read(const NodeStmt *stmt, std::vector<uint32_t> &names)
+    {
+        const auto expr = [&](const ExprRef ref)
+        {
+            m_read_stack.push_back(ref.root);
+            while (!m_read_stack.empty())
+            {
+                const NodeExpr &node = ref.pool[m_read_stack.back()];
+                m_read_stack.pop_back();
+                if (node.op == ExprOp::ident)
+                {
+                    names.push_back(node.lhs);
+                }
+                else if (!is_leaf(node.op))
+                {
+                    m_read_stack.push_back(node.lhs);
+                    m_read_stack.push_back(node.rhs);
+                }
+            }
+        };
+        visit_stmts(stmt, [&](const NodeStmt *next)
+                    {
+                        if (const auto *stmt_exit = std::get_if<NodeStmtExit *>(&next->var))
+                        {
+                            expr((*stmt_exit)->expr);
+                        }
+                        else if (const auto *let = std::get_if<NodeStmtLet *>(&next->var))
+                        {
+                            expr((*let)->expr);
+                        }
+                        else if (const auto *assign = std::get_if<NodeStmtAssign *>(&next->var))
+                        {
+                            expr((*assign)->expr);
+                        }
+                        else if (const auto *print = std::get_if<NodeStmtPrint *>(&next->var))
+                        {
+                            expr((*print)->expr);
+                        }
+                        else if (const auto *stmt_if = std::get_if<NodeStmtIf *>(&next->var))
+                        {
+                            expr((*stmt_if)->expr);
+                            for (std::optional<NodeIfPred *> pred = (*stmt_if)->pred; pred.has_value();)
+                            {
+                                const auto *elif = std::get_if<NodeIfPredElif *>(&pred.value()->var);
+                                if (elif == nullptr)
+                                {
+                                    break;
+                                }
+                                expr((*elif)->expr);
+                                pred = (*elif)->pred;
+                            }
+                        } });
+    }
+
+    // variables of these names are assigned somewhere in the program, variables of other names are constants when
+    // they are declared with one
+    // the names are those of the whole program, so code generated before a change of them is out of date
+    void set_assigned(const std::span<const uint32_t> names)
+    {
+        set_names(m_assigned, names);
+    }
+
+    // variables of these names are read somewhere in the program, top-level variables of other names get no stack
+    // slot, as for set_assigned() code generated before a change of them is out of date
+    void set_read(const std::span<const uint32_t> names)
+    {
+        set_names(m_read, names);
+    }
+
+    // code generated since the last call, for generating a program one top-level statement at a time
+    std::string take_output()
+    {
+        return m_output.take();
+    }
+
+    // how many of the statements after a top-level statement its dead stores are found from
+    static constexpr size_t look_ahead = 8;
+
+    // what dead-code elimination removed beyond what the IR optimizer counts
+    struct DceStats
+    {
+        size_t unreachable = 0; // top-level statements after one that always exits
+        size_t slots = 0;       // top-level variables that got no stack slot
+    };
+
+    [[nodiscard]] const DceStats &dce_stats() const
+    {
+        return m_dce;
+    }
+
+    // IR instructions and optimizations so far
+    [[nodiscard]] const IrOptimizer::Stats &ir_stats() const
+    {
+        return m_optimizer.stats();
+    }
+
+    // registers given out so far
+    [[nodiscard]] const RegisterAllocator::Stats &alloc_stats() const
+    {
+        return m_allocator.stats();
+    }
+
+    // peephole rules and how often each applied so far
+    [[nodiscard]] const std::vector<Peephole::Rule> &peephole_rules() const
+    {
+        return m_peephole.rules();
+    }
+
+    // the optimized IR of every statement is written to out as well, null for none
+    void set_ir_output(std::ostream *out)
+    {
+        m_ir_output = out;
+    }
+
+    // what dead-code elimination removes from every statement is listed on out, null for none
+    void set_dce_report(std::ostream *out)
+    {
+        m_dce_report = out;
+    }
+
+    // variables are named by the string id of their identifier, equal names have equal ids
+    struct Var
+    {
+        uint32_t name;
+        size_t stack_loc; // for top-level variables, stack depth that counts the variable
+        size_t byte_size;
+        IrValue current = ir_none; // for local variables, value the variable holds at this point of the statement
+        uint32_t shadowed = 0;     // variable of the same name this one hides, as index + 1 into m_vars, 0 for none
+        bool constant = false;     // whether the variable is never assigned and holds value throughout
+        int64_t value = 0;
+        bool operator==(const Var &) const = default;
+    };
+
+    // position of the generator between two top-level statements
+    // top-level variables are never popped, so the variables at a mark are the first var_count of the current ones
+    struct Mark
+    {
+        size_t stack_size;
+        size_t var_count;
+        size_t label_count;
+        size_t var_byte_size;
+        bool unreachable;
+        bool operator==(const Mark &) const = default;
+    };
+
+    [[nodiscard]] Mark mark() const
+    {
+        assert(m_scopes.empty());
+        return {m_stack_size, m_vars.size(), label_count, m_var_byte_size, m_unreachable};
+    }
+
+    // returns to a mark taken earlier, the statements generated before the mark must not have changed since
+    void rewind(const Mark &mark)
+    {
+        m_stack_size = mark.stack_size;
+        pop_vars(m_vars.size() - mark.var_count);
+        m_scopes.clear();
+        m_expr_stack.clear();
+        m_values.clear();
+        m_assign_log.clear();
+        m_edges.clear();
+        m_changes.clear();
+        label_count = mark.label_count;
+        m_var_byte_size = mark.var_byte_size;
+        m_unreachable = mark.unreachable;
+    }
+
+    [[nodiscard]] const std::vector<Var> &vars() const
+    {
+        return m_vars;
+    }
+
+    void set_vars(const std::vector<Var> &vars)
+    {
+        pop_vars(m_vars.size());
+        for (const Var &var : vars)
+        {
+            declare(var);
         }
-        // implicit exit with 0 after successful completion of program
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        m_output << m_bss.str();
-        return m_output.str();
     }
 
 private:
-    // push register value to top of stack / pop top of stack to register and increment / decrement stack size for keeping track of identifiers
-    void push(const std::string &reg)
+    // how far a visit of an expression node has got
+    enum class ExprStep : uint8_t
+    {
+        schedule,        // operands not yet generated
+        apply,           // lhs generated before rhs
+        apply_rhs_first, // rhs generated before lhs
+    };
+
+    // jump from the end of block from to a block started later, slot is the successor of from it is
+    struct Edge
+    {
+        IrBlockId from;
+        uint8_t slot;
+    };
+
+    // where the state of the generator stood when an if statement started
+    struct IfBranches
+    {
+        size_t vars;    // variables declared before the statement, the ones its branches can assign
+        size_t log;     // assignments logged before the statement
+        size_t edges;   // edges to the blocks joining enclosing statements
+        size_t changes; // values enclosing statements recorded for their branches
+    };
+
+    // value a local variable was left with by a branch of an if statement
+    struct Change
+    {
+        uint32_t var; // index into m_vars
+        uint32_t branch;
+        IrValue value;
+    };
+
+    [[nodiscard]] bool assigned(const uint32_t name) const
+    {
+        return name < m_assigned.size() && m_assigned[name];
+    }
+
+    [[nodiscard]] bool read(const uint32_t name) const
+    {
+        return name < m_read.size() && m_read[name];
+    }
+
+    // by string id, whether it is one of names
+    void set_names(std::vector<bool> &set, const std::span<const uint32_t> names) const
+    {
+        set.assign(m_strings.size(), false);
+        for (const uint32_t name : names)
+        {
+            if (name >= set.size())
+            {
+                set.resize(name + 1, false);
+            }
+            set[name] = true;
+        }
+    }
+
+    // calls visit with stmt and every statement nested in it
+    template <typename Visit>
+    void visit_stmts(const NodeStmt *stmt, Visit visit)
+    {
+        std::vector<const NodeStmt *> &stack = m_stmt_stack;
+        stack.push_back(stmt);
+        const auto push_scope = [&](const NodeScope *scope)
+        {
+            stack.insert(stack.end(), scope->stmts.begin(), scope->stmts.end());
+        };
+        while (!stack.empty())
+        {
+            const NodeStmt *next = stack.back();
+            stack.pop_back();
+            visit(next);
+            if (const auto *scope = std::get_if<NodeScope *>(&next->var))
+            {
+                push_scope(*scope);
+            }
+            else if (const auto *stmt_if = std::get_if<NodeStmtIf *>(&next->var))
+            {
+                push_scope((*stmt_if)->scope);
+                for (std::optional<NodeIfPred *> pred = (*stmt_if)->pred; pred.has_value();)
+                {
+                    if (const auto *elif = std::get_if<NodeIfPredElif *>(&pred.value()->var))
+                    {
+                        push_scope((*elif)->scope);
+                        pred = (*elif)->pred;
+                    }
+                    else
+                    {
+                        push_scope(std::get<NodeIfPredElse *>(pred.value()->var)->scope);
+                        pred = std::nullopt;
+                    }
+                }
+            }
+        }
+    }
+
+    // stack slots of top-level variables that the statements in m_following assign before anything reads them, or all
+    // of them when those statements exit first
+    // only simple statements are followed, an if or a scope ends the search
+    std::span<const int64_t> dead_at_end()
+    {
+        m_dead_slots.clear();
+        if (std::none_of(m_ir.insts.begin(), m_ir.insts.end(), [](const IrInst &inst)
+                         { return inst.op == IrOp::store; }))
+        {
+            return m_dead_slots;
+        }
+        m_reads.clear();
+        m_killed.clear();
+        for (const NodeStmt *stmt : m_following)
+        {
+            collect_read(stmt, m_reads);
+            if (const auto *assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            {
+                const uint32_t name = (*assign)->ident.value;
+                if (std::find(m_reads.begin(), m_reads.end(), name) == m_reads.end())
+                {
+                    m_killed.push_back(name);
+                }
+            }
+            else if (std::holds_alternative<NodeStmtExit *>(stmt->var))
+            {
+                for (const Var &var : m_vars)
+                {
+                    if (var.stack_loc != 0 && std::find(m_reads.begin(), m_reads.end(), var.name) == m_reads.end())
+                    {
+                        m_dead_slots.push_back(static_cast<int64_t>(var.stack_loc));
+                    }
+                }
+                return m_dead_slots;
+            }
+            else if (!std::holds_alternative<NodeStmtLet *>(stmt->var) && !std::holds_alternative<NodeStmtPrint *>(stmt->var))
+            {
+                break;
+            }
+        }
+        for (const uint32_t name : m_killed)
+        {
+            const Var *var = lookup(name);
+            if (var != nullptr && var->stack_loc != 0)
+            {
+                m_dead_slots.push_back(static_cast<int64_t>(var->stack_loc));
+            }
+        }
+        return m_dead_slots;
+    }
+
+    // starts a line of the dead-code report about the current statement
+    std::ostream &report()
     {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
+        return *m_dce_report << "[dce] statement " << m_stmt_count << ": ";
     }
 
-    void pop(const std::string &reg)
+    // lists what the IR optimizer removed from the current statement
+    void report_removed()
     {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+        const IrOptimizer::Removed &removed = m_optimizer.removed();
+        if (removed.blocks != 0)
+        {
+            report() << removed.blocks << " unreachable blocks removed" << std::endl;
+        }
+        for (const int64_t slot : removed.stores)
+        {
+            // top-level variables are the only ones left after the statement, in the order of their slots
+            const auto var = std::find_if(m_vars.begin(), m_vars.end(), [&](const Var &v)
+                                          { return static_cast<int64_t>(v.stack_loc) == slot; });
+            report() << "dead store to " << m_strings.text(var->name) << " removed" << std::endl;
+        }
+        if (removed.insts != 0)
+        {
+            report() << removed.insts << " instructions computing unused values removed" << std::endl;
+        }
+    }
+
+    IrValue constant(const int64_t value)
+    {
+        return m_ir.add({IrOp::constant, IrType::i64, ir_none, ir_none, value});
+    }
+
+    // starts a new block the edges jump to, they come from blocks in layout order
+    void start_block(const std::span<const Edge> edges)
+    {
+        const auto id = static_cast<IrBlockId>(m_ir.blocks.size());
+        const auto at = static_cast<uint32_t>(m_ir.insts.size());
+        m_ir.blocks.push_back({at, at, static_cast<uint32_t>(m_ir.preds.size()), static_cast<uint32_t>(edges.size())});
+        for (const Edge &edge : edges)
+        {
+            m_ir.blocks[edge.from].succ[edge.slot] = id;
+            m_ir.preds.push_back(edge.from);
+        }
+    }
+
+    // a local variable holds a new value, the old one is logged so the if statement around can restore it for its
+    // next branch
+    void assign(const size_t var, const IrValue value)
+    {
+        m_assign_log.emplace_back(static_cast<uint32_t>(var), m_vars[var].current);
+        m_vars[var].current = value;
+    }
+
+    // generates the branch taken when the condition is not 0 and returns the edge to what follows otherwise
+    Edge gen_branch(const ExprRef condition, const NodeScope *scope, const IfBranches &branches, uint32_t &count)
+    {
+        const IrValue value = gen_expr(condition);
+        m_ir.add({IrOp::br, IrType::none, value});
+        const auto test = static_cast<IrBlockId>(m_ir.blocks.size() - 1);
+        const Edge taken{test, 0};
+        start_block({&taken, 1});
+        gen_scope(scope);
+        end_branch(branches, count);
+        return {test, 1};
+    }
+
+    // ends a branch with a jump to the block joining the branches, records the values it left in the variables of
+    // enclosing scopes and restores the values they had before the statement
+    void end_branch(const IfBranches &branches, uint32_t &count)
+    {
+        m_ir.add({IrOp::jmp});
+        m_edges.push_back({static_cast<IrBlockId>(m_ir.blocks.size() - 1), 0});
+        if (m_stamp.size() < m_vars.size())
+        {
+            m_stamp.resize(m_vars.size(), 0);
+        }
+        m_stamp_count++;
+        // the latest assignment of a variable is met first, older ones restore what it held before
+        for (size_t i = m_assign_log.size(); i > branches.log; i--)
+        {
+            const auto [var, old] = m_assign_log[i - 1];
+            if (var >= branches.vars)
+            {
+                continue; // declared in the branch and gone with its scope
+            }
+            if (m_stamp[var] != m_stamp_count)
+            {
+                m_stamp[var] = m_stamp_count;
+                m_changes.push_back({var, count, m_vars[var].current});
+            }
+            m_vars[var].current = old;
+        }
+        m_assign_log.resize(branches.log);
+        count++;
+    }
+
+    // a variable the branches left with different values gets a phi in the block joining them, which the current
+    // block is by now
+    void join(const IfBranches &branches, const uint32_t count)
+    {
+        const auto changes = std::span<Change>(m_changes).subspan(branches.changes);
+        std::sort(changes.begin(), changes.end(),
+                  [](const Change &lhs, const Change &rhs)
+                  { return lhs.var < rhs.var; });
+        for (size_t i = 0; i < changes.size();)
+        {
+            const uint32_t var = changes[i].var;
+            // a branch that did not assign the variable passes on the value from before the statement
+            const auto args = static_cast<uint32_t>(m_ir.phi_args.size());
+            m_ir.phi_args.resize(args + count, m_vars[var].current);
+            for (; i < changes.size() && changes[i].var == var; i++)
+            {
+                m_ir.phi_args[args + changes[i].branch] = changes[i].value;
+            }
+            const auto values = std::span<const IrValue>(m_ir.phi_args).subspan(args);
+            if (std::all_of(values.begin(), values.end(), [&](const IrValue v) { return v == values.front(); }))
+            {
+                const IrValue value = values.front();
+                m_ir.phi_args.resize(args);
+                if (value != m_vars[var].current)
+                {
+                    assign(var, value);
+                }
+                continue;
+            }
+            assign(var, m_ir.add({IrOp::phi, IrType::i64, args}));
+        }
+        m_changes.resize(branches.changes);
     }
 
     void begin_scope()
@@ -353,38 +963,107 @@ private:
     void end_scope()
     {
         // to remove local varibles after the end of scope
-        // finding no. of variables to be removed = total no. of variables - total no. of variables before the start of scope
-        const size_t pop_count = m_vars.size() - m_scopes.back();
-        if (pop_count != 0)
+        pop_vars(m_vars.size() - m_scopes.back());
+        m_scopes.pop_back(); // pop the scope from m_scope
+    }
+
+    // innermost variable of a name, or null when none is in scope
+    [[nodiscard]] const Var *lookup(const uint32_t name) const
+    {
+        if (name >= m_innermost.size() || m_innermost[name] == 0)
+        {
+            return nullptr;
+        }
+        return &m_vars[m_innermost[name] - 1];
+    }
+
+    // adds a variable, it hides any variable of the same name until it is popped
+    void declare(Var var)
+    {
+        if (var.name >= m_innermost.size())
         {
-            m_output << "    add rsp, " << pop_count * 8 << "\n"; // increasing rsp reduces stack size
+            m_innermost.resize(std::max<size_t>(m_strings.size(), var.name + 1), 0);
         }
-        m_stack_size -= pop_count;
-        for (int i = 0; i < pop_count; i++)
+        var.shadowed = m_innermost[var.name];
+        m_vars.push_back(var);
+        m_innermost[var.name] = static_cast<uint32_t>(m_vars.size());
+    }
+
+    // removes the last count variables, each uncovering the one it hid
+    void pop_vars(const size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
         {
-            m_vars.pop_back(); // pop the local variables from m_vars
+            m_innermost[m_vars.back().name] = m_vars.back().shadowed;
+            m_vars.pop_back();
         }
-        m_scopes.pop_back(); // pop the scope from m_scope
     }
 
-    std::string create_label()
+    // whether the code is written out as assembly
+    [[nodiscard]] bool writes_text() const
     {
-        return "label" + std::to_string(label_count++); // create distinct labels for looping and branching stmts
+        return m_encoder == nullptr && m_bytecode == nullptr;
     }
 
-    struct Var
+    // writes or encodes an instruction
+    void emit(const Inst &inst)
     {
-        std::string name;
-        size_t stack_loc;
-        size_t byte_size;
-    };
+        if (m_encoder != nullptr)
+        {
+            m_encoder->encode(inst);
+        }
+        else
+        {
+            write_inst(m_output, inst, m_strings);
+        }
+    }
+
+    // text of an identifier or literal token
+    [[nodiscard]] std::string_view text(const Token &token) const
+    {
+        return m_strings.text(token.value);
+    }
 
     const NodeProg m_prog;          // parsed tree
-    std::stringstream m_output;     // final assembly code
-    size_t m_stack_size = 0;        // size of stack in assembly code
+    const StringTable &m_strings;   // text of identifiers and literals
+    AsmWriter m_output;             // final assembly code
+    X86Encoder *m_encoder = nullptr; // final machine code instead, see set_encoder()
+    BytecodeCompiler *m_bytecode = nullptr; // or bytecode, see set_bytecode()
+    size_t m_stack_size = 0;        // size of stack in assembly code between top-level statements
     std::vector<Var> m_vars{};      // variables in program
     std::vector<size_t> m_scopes{}; // for local variables in a scope
     size_t label_count = 0;         // for creating distinct labels
-    std::stringstream m_bss;
+    AsmWriter m_bss;
     size_t m_var_byte_size = 0;
-};
\ No newline at end of file
+    std::vector<std::pair<ExprId, ExprStep>> m_expr_stack{}; // expression nodes left to visit, and how far each has got
+    std::vector<IrValue> m_values{};                         // values of visited operands
+    std::vector<const NodeStmt *> m_stmt_stack{};            // statements left to visit by visit_stmts()
+    std::vector<uint32_t> m_innermost{}; // by string id, innermost variable of that name as index + 1 into m_vars
+    std::vector<bool> m_assigned{};      // by string id, whether a variable of that name is assigned anywhere
+    std::vector<bool> m_read{};          // by string id, whether an identifier of that name is read anywhere
+    std::vector<ExprId> m_read_stack{};  // expression nodes left to visit by collect_read()
+    bool m_unreachable = false;          // whether a statement generated so far always exits
+    std::span<const NodeStmt *const> m_following{}; // statements after the current one, see gen_stmt()
+    std::vector<int64_t> m_dead_slots{}; // scratch of dead_at_end()
+    std::vector<uint32_t> m_reads{};
+    std::vector<uint32_t> m_killed{};
+    DceStats m_dce{};
+    std::ostream *m_dce_report = nullptr;
+    // IR of the top-level statement being generated
+    IrFunction m_ir{};
+    std::vector<std::pair<uint32_t, IrValue>> m_assign_log{}; // local variables assigned, with the value each held
+    std::vector<Edge> m_edges{};     // jumps from the ends of branches to the blocks joining them
+    std::vector<Change> m_changes{}; // values the branches of if statements left in variables
+    std::vector<uint32_t> m_stamp{}; // by variable, the last end_branch() that recorded it
+    uint32_t m_stamp_count = 0;
+    size_t m_stmt_count = 0;         // top-level statements generated
+    std::ostream *m_ir_output = nullptr;
+    IrOptimizer m_optimizer{};
+    // code of the top-level statement being generated
+    InstructionSelector m_selector{};
+    std::vector<Inst> m_insts{};     // with virtual registers
+    RegisterAllocator m_allocator{};
+    std::vector<Inst> m_allocated{}; // with registers
+    Peephole m_peephole{};
+    std::vector<Inst> m_optimized{}; // after the peephole rules
+};
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "./string_table.hpp"
+
+// intermediate representation between the parse tree and machine code
+// the code of a top-level statement is a function of basic blocks in three-address form, every value is defined by
+// exactly one instruction (static single assignment) and named by the index of that instruction
+// the language has no loops, so blocks are laid out in an order where every jump goes forward and every value is
+// defined before the instructions that use it
+// variables declared at the top level live in stack slots between statements and are read and written with load and
+// store, variables local to a scope are values, with a phi where branches that assign them different values join
+
+// type of the value an instruction defines
+enum class IrType : uint8_t
+{
+    none, // defines no value
+    i64,  // 64-bit integer, operations treat it as unsigned
+};
+
+enum class IrOp : uint8_t
+{
+    constant, // imm
+    lit,      // literal left to the assembler as written, imm is its string id
+    load,     // top-level variable, imm is its stack slot as in Generator::Var::stack_loc
+    add,      // a + b
+    sub,      // a - b
+    mul,      // a * b, low 64 bits
+    udiv,     // a / b
+    urem,     // a % b
+    phi,      // a is the index of its first argument in IrFunction::phi_args, one per predecessor of its block
+    copy,     // a, left behind where an optimization found the value of an instruction elsewhere
+    store,    // top-level variable in stack slot imm = a
+    push,     // declares a top-level variable holding a in a new stack slot, only at the end of the function
+    nop,      // left behind where an optimization removed an instruction
+    br,       // to the first successor of the block if a is not 0, to the second otherwise
+    jmp,      // to the successor of the block
+    exit,     // ends the program with status a
+    ret,      // end of the statement, the program goes on with the next one
+};
+
+inline bool is_terminator(const IrOp op)
+{
+    return op >= IrOp::br;
+}
+
+inline std::string_view to_string(const IrOp op)
+{
+    static constexpr std::string_view names[] = {
+        "const", "lit", "load", "add", "sub", "mul", "udiv", "urem", "phi", "copy",
+        "store", "push", "nop", "br", "jmp", "exit", "ret"};
+    return names[static_cast<size_t>(op)];
+}
+
+// number of values an instruction other than phi reads, from a on
+inline uint32_t operand_count(const IrOp op)
+{
+    switch (op)
+    {
+    case IrOp::constant:
+    case IrOp::lit:
+    case IrOp::load:
+    case IrOp::nop:
+    case IrOp::jmp:
+    case IrOp::ret:
+        return 0;
+    case IrOp::add:
+    case IrOp::sub:
+    case IrOp::mul:
+    case IrOp::udiv:
+    case IrOp::urem:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+using IrValue = uint32_t;
+using IrBlockId = uint32_t;
+
+constexpr uint32_t ir_none = UINT32_MAX;
+
+struct IrInst
+{
+    IrOp op;
+    IrType type = IrType::none;
+    uint32_t a = ir_none; // operands
+    uint32_t b = ir_none;
+    int64_t imm = 0;
+};
+
+// instructions of a block are contiguous, it ends with its only terminator, phis come first
+struct IrBlock
+{
+    uint32_t begin;                       // instructions [begin, end)
+    uint32_t end;
+    uint32_t preds;                       // predecessors [preds, preds + pred_count) in IrFunction::preds
+    uint32_t pred_count;
+    IrBlockId succ[2] = {ir_none, ir_none}; // targets of the terminator
+    bool live = true;                     // false once optimizations find the block is never reached
+};
+
+struct IrFunction
+{
+    std::vector<IrInst> insts;
+    std::vector<IrBlock> blocks;
+    std::vector<IrBlockId> preds;
+    std::vector<IrValue> phi_args;
+
+    void clear()
+    {
+        insts.clear();
+        blocks.clear();
+        preds.clear();
+        phi_args.clear();
+    }
+
+    // appends an instruction to the last block
+    IrValue add(const IrInst inst)
+    {
+        insts.push_back(inst);
+        blocks.back().end = static_cast<uint32_t>(insts.size());
+        return static_cast<IrValue>(insts.size() - 1);
+    }
+
+    [[nodiscard]] std::span<const IrBlockId> preds_of(const IrBlock &block) const
+    {
+        return std::span<const IrBlockId>(preds).subspan(block.preds, block.pred_count);
+    }
+
+    [[nodiscard]] std::span<const IrValue> args_of(const IrInst &phi, const IrBlock &block) const
+    {
+        return std::span<const IrValue>(phi_args).subspan(phi.a, block.pred_count);
+    }
+
+    [[nodiscard]] const IrInst &terminator(const IrBlock &block) const
+    {
+        return insts[block.end - 1];
+    }
+
+    // the value a value stands for, looking through copies
+    [[nodiscard]] IrValue resolve(IrValue value) const
+    {
+        while (insts[value].op == IrOp::copy)
+        {
+            value = insts[value].a;
+        }
+        return value;
+    }
+};
+
+// writes the live blocks of a function as text, for --emit-ir
+inline void write_ir(std::ostream &out, const IrFunction &fn, const StringTable &strings)
+{
+    const auto value = [&](const IrValue v)
+    {
+        out << "%" << v;
+    };
+    for (IrBlockId id = 0; id < fn.blocks.size(); id++)
+    {
+        const IrBlock &block = fn.blocks[id];
+        if (!block.live)
+        {
+            continue;
+        }
+        out << "b" << id << ":";
+        if (block.pred_count != 0)
+        {
+            out << " ; preds";
+            for (const IrBlockId pred : fn.preds_of(block))
+            {
+                out << " b" << pred << (fn.blocks[pred].live ? "" : " (dead)");
+            }
+        }
+        out << "\n";
+        for (uint32_t i = block.begin; i < block.end; i++)
+        {
+            const IrInst &inst = fn.insts[i];
+            if (inst.op == IrOp::nop)
+            {
+                continue;
+            }
+            out << "    ";
+            if (inst.type != IrType::none)
+            {
+                value(i);
+                out << " = ";
+            }
+            out << to_string(inst.op);
+            if (inst.type == IrType::i64)
+            {
+                out << ".i64";
+            }
+            switch (inst.op)
+            {
+            case IrOp::constant:
+                out << " " << inst.imm;
+                break;
+            case IrOp::lit:
+                out << " " << strings.text(static_cast<uint32_t>(inst.imm));
+                break;
+            case IrOp::load:
+                out << " slot " << inst.imm;
+                break;
+            case IrOp::store:
+                out << " slot " << inst.imm << ", ";
+                value(inst.a);
+                break;
+            case IrOp::phi:
+            {
+                const std::span<const IrValue> args = fn.args_of(inst, block);
+                for (size_t k = 0; k < args.size(); k++)
+                {
+                    out << (k == 0 ? " [b" : ", [b") << fn.preds_of(block)[k] << ": ";
+                    value(args[k]);
+                    out << "]";
+                }
+                break;
+            }
+            case IrOp::br:
+                out << " ";
+                value(inst.a);
+                out << ", b" << block.succ[0] << ", b" << block.succ[1];
+                break;
+            case IrOp::jmp:
+                out << " b" << block.succ[0];
+                break;
+            case IrOp::ret:
+                break;
+            default:
+                out << " ";
+                value(inst.a);
+                if (inst.b != ir_none)
+                {
+                    out << ", ";
+                    value(inst.b);
+                }
+            }
+            out << "\n";
+        }
+    }
+}
+
+// checks the invariants the optimizations and instruction selection rely on, reports the first one broken
+// blocks found to be dead are never selected, the values they read may have been removed
+inline bool verify_ir(const IrFunction &fn)
+{
+    const auto error = [](const std::string_view what, const uint32_t at)
+    {
+        std::cerr << "[IR error] " << what << " at %" << at << std::endl;
+        return false;
+    };
+    // every predecessor is a distinct edge to its block, so the predecessors match the edges when there are as many
+    size_t edges = 0;
+    size_t preds = 0;
+    uint32_t next = 0;
+    for (IrBlockId id = 0; id < fn.blocks.size(); id++)
+    {
+        const IrBlock &block = fn.blocks[id];
+        if (block.begin != next || block.end <= block.begin)
+        {
+            return error("block out of place or empty", block.begin);
+        }
+        next = block.end;
+        preds += block.pred_count;
+        IrBlockId previous = 0;
+        for (const IrBlockId pred : fn.preds_of(block))
+        {
+            if (pred >= id || (pred < previous) || (fn.blocks[pred].succ[0] != id && fn.blocks[pred].succ[1] != id))
+            {
+                return error("predecessor out of order or not jumping forward to the block", block.begin);
+            }
+            previous = pred + 1;
+        }
+        bool phis = true;
+        for (uint32_t i = block.begin; i < block.end; i++)
+        {
+            const IrInst &inst = fn.insts[i];
+            if (is_terminator(inst.op) != (i == block.end - 1))
+            {
+                return error("terminator not at the end of its block", i);
+            }
+            if (inst.op == IrOp::phi)
+            {
+                if (!phis)
+                {
+                    return error("phi after other instructions", i);
+                }
+                if (inst.a + block.pred_count > fn.phi_args.size())
+                {
+                    return error("phi arguments out of range", i);
+                }
+                // an argument coming from a dead predecessor is never read, it may have been removed
+                const std::span<const IrValue> args = fn.args_of(inst, block);
+                const std::span<const IrBlockId> preds_of_block = fn.preds_of(block);
+                for (size_t k = 0; k < args.size(); k++)
+                {
+                    const IrValue arg = args[k];
+                    const bool read = block.live && fn.blocks[preds_of_block[k]].live;
+                    if (arg >= block.begin || (read && fn.insts[arg].type != IrType::i64))
+                    {
+                        return error("phi argument not defined before the block", i);
+                    }
+                }
+            }
+            else
+            {
+                // a phi that was folded or removed stays among the phis
+                phis = phis && (inst.op == IrOp::copy || inst.op == IrOp::constant || inst.op == IrOp::nop);
+                const uint32_t operands = operand_count(inst.op);
+                for (const uint32_t operand : {inst.a, inst.b})
+                {
+                    if (operand == ir_none)
+                    {
+                        continue;
+                    }
+                    if (operand >= i || (block.live && fn.insts[operand].type != IrType::i64))
+                    {
+                        return error("operand not an i64 value defined before its use", i);
+                    }
+                }
+                if ((operands >= 1) != (inst.a != ir_none) || (operands == 2) != (inst.b != ir_none))
+                {
+                    return error("wrong number of operands", i);
+                }
+            }
+            const bool defines = inst.op < IrOp::store;
+            if (defines != (inst.type == IrType::i64))
+            {
+                return error("wrong type", i);
+            }
+            if (inst.op == IrOp::push && (i + 2 != fn.insts.size() || fn.insts.back().op != IrOp::ret))
+            {
+                return error("push not right before the final ret", i);
+            }
+        }
+        const IrInst &last = fn.terminator(block);
+        const uint32_t succs = last.op == IrOp::br ? 2 : last.op == IrOp::jmp ? 1 : 0;
+        for (uint32_t k = 0; k < 2; k++)
+        {
+            const IrBlockId succ = block.succ[k];
+            if ((k < succs) != (succ != ir_none) || (succ != ir_none && (succ <= id || succ >= fn.blocks.size())))
+            {
+                return error("successor missing or not forward", block.end - 1);
+            }
+            edges += succ != ir_none ? 1 : 0;
+        }
+        if (succs == 2 && block.succ[0] == block.succ[1])
+        {
+            return error("branch to the same block both ways", block.end - 1);
+        }
+        // an edge from a block that branches two ways ends in a block with no other predecessors, so the copies
+        // for phis can go at the end of the predecessor
+        if (succs == 2 && (fn.blocks[block.succ[0]].pred_count != 1 || fn.blocks[block.succ[1]].pred_count != 1))
+        {
+            return error("critical edge", block.end - 1);
+        }
+        if (last.op == IrOp::ret && id + 1 != fn.blocks.size())
+        {
+            return error("ret before the last block", block.end - 1);
+        }
+    }
+    if (fn.blocks.empty() || next != fn.insts.size())
+    {
+        return error("instructions outside blocks", next);
+    }
+    if (edges != preds)
+    {
+        return error("predecessors do not match the jumps to blocks", next);
+    }
+    return true;
+}
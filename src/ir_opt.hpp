@@ -0,0 +1,394 @@
+#pragma once
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+
+#include "./diagnostics.hpp"
+#include "./ir.hpp"
+
+// optimizations on the IR of a top-level statement
+// every jump goes forward, so a single pass over the blocks in layout order sees the definition of every value and
+// every predecessor of a block before the instructions that depend on them
+class IrOptimizer
+{
+
+public:
+    // totals over every function optimized so far, reported by --stats
+    struct Stats
+    {
+        size_t insts = 0;       // instructions in the functions
+        size_t folded = 0;      // instructions replaced by a constant, a copy or a jump
+        size_t dead_blocks = 0; // blocks found to be never reached
+        size_t dead_insts = 0;  // instructions removed because nothing uses their value
+        size_t dead_stores = 0; // stores removed because the slot is stored again or the program exits before a load
+    };
+
+    // what eliminate() removed from the last function, for reporting it
+    struct Removed
+    {
+        size_t blocks = 0;
+        size_t insts = 0;
+        std::vector<int64_t> stores{}; // stack slots of the dead stores
+    };
+
+    // the first pass, constants are folded and blocks never reached are found
+    void fold(IrFunction &fn)
+    {
+        m_removed.blocks = m_stats.dead_blocks;
+        fold_blocks(fn);
+        m_removed.blocks = m_stats.dead_blocks - m_removed.blocks;
+        m_stats.insts += fn.insts.size();
+    }
+
+    // the second pass, dead stores are removed and then the instructions computing values nothing uses
+    // dead_at_end are the slots the statements after the function store to before loading them
+    void eliminate(IrFunction &fn, const std::span<const int64_t> dead_at_end = {})
+    {
+        m_removed.insts = 0;
+        m_removed.stores.clear();
+        remove_dead_stores(fn, dead_at_end);
+        remove_unused(fn);
+        m_stats.dead_insts += m_removed.insts;
+        m_stats.dead_stores += m_removed.stores.size();
+    }
+
+    [[nodiscard]] const Stats &stats() const
+    {
+        return m_stats;
+    }
+
+    [[nodiscard]] const Removed &removed() const
+    {
+        return m_removed;
+    }
+
+    // value of an operation on two constants, the values are unsigned as the instructions selected for them treat
+    // them, the division by zero is caught before
+    static uint64_t fold(const IrOp op, const uint64_t lhs, const uint64_t rhs)
+    {
+        switch (op)
+        {
+        case IrOp::add:
+            return lhs + rhs;
+        case IrOp::sub:
+            return lhs - rhs;
+        case IrOp::mul:
+            return lhs * rhs;
+        case IrOp::udiv:
+            return lhs / rhs;
+        case IrOp::urem:
+            return lhs % rhs;
+        default:
+            assert(false);
+            return 0;
+        }
+    }
+
+private:
+    // operations on constants are done here, a phi whose arguments from live blocks agree is replaced by the value
+    // they agree on, and a branch on a constant becomes a jump, so the block it no longer goes to is dead
+    // division by a constant zero is an error wherever it is, dead blocks included
+    void fold_blocks(IrFunction &fn)
+    {
+        for (IrBlockId id = 0; id < fn.blocks.size(); id++)
+        {
+            IrBlock &block = fn.blocks[id];
+            block.live = id == 0;
+            for (const IrBlockId pred : fn.preds_of(block))
+            {
+                block.live = block.live || fn.blocks[pred].live;
+            }
+            if (!block.live)
+            {
+                m_stats.dead_blocks++;
+            }
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                fold_inst(fn, block, i);
+            }
+        }
+    }
+
+    void fold_inst(IrFunction &fn, IrBlock &block, const uint32_t i)
+    {
+        IrInst &inst = fn.insts[i];
+        switch (inst.op)
+        {
+        case IrOp::add:
+        case IrOp::sub:
+        case IrOp::mul:
+        case IrOp::udiv:
+        case IrOp::urem:
+        {
+            inst.a = fn.resolve(inst.a);
+            inst.b = fn.resolve(inst.b);
+            const IrInst &lhs = fn.insts[inst.a];
+            const IrInst &rhs = fn.insts[inst.b];
+            if ((inst.op == IrOp::udiv || inst.op == IrOp::urem) && rhs.op == IrOp::constant && rhs.imm == 0)
+            {
+                std::cerr << "Division by zero" << std::endl;
+                fail();
+            }
+            if (lhs.op == IrOp::constant && rhs.op == IrOp::constant)
+            {
+                const uint64_t value = fold(inst.op, static_cast<uint64_t>(lhs.imm), static_cast<uint64_t>(rhs.imm));
+                inst = {IrOp::constant, IrType::i64, ir_none, ir_none, static_cast<int64_t>(value)};
+                m_stats.folded++;
+            }
+            else if (simplify(fn, inst))
+            {
+                m_stats.folded++;
+            }
+            break;
+        }
+        case IrOp::phi:
+        {
+            if (!block.live)
+            {
+                break;
+            }
+            const std::span<const IrValue> args = fn.args_of(inst, block);
+            const std::span<const IrBlockId> preds = fn.preds_of(block);
+            IrValue same = ir_none;
+            for (size_t k = 0; k < args.size(); k++)
+            {
+                if (!fn.blocks[preds[k]].live)
+                {
+                    continue;
+                }
+                const IrValue arg = fn.resolve(args[k]);
+                if (same == ir_none || same == arg ||
+                    (fn.insts[same].op == IrOp::constant && fn.insts[arg].op == IrOp::constant && fn.insts[same].imm == fn.insts[arg].imm))
+                {
+                    same = arg;
+                }
+                else
+                {
+                    return;
+                }
+            }
+            if (fn.insts[same].op == IrOp::constant)
+            {
+                inst = {IrOp::constant, IrType::i64, ir_none, ir_none, fn.insts[same].imm};
+            }
+            else
+            {
+                inst = {IrOp::copy, IrType::i64, same};
+            }
+            m_stats.folded++;
+            break;
+        }
+        case IrOp::br:
+        {
+            inst.a = fn.resolve(inst.a);
+            const IrInst &cond = fn.insts[inst.a];
+            if (cond.op != IrOp::constant)
+            {
+                break;
+            }
+            // the targets of a branch have no other predecessor and so no phis, the one not taken is left with none
+            const uint32_t taken = cond.imm != 0 ? 0 : 1;
+            fn.blocks[block.succ[1 - taken]].pred_count = 0;
+            block.succ[0] = block.succ[taken];
+            block.succ[1] = ir_none;
+            inst = {IrOp::jmp};
+            m_stats.folded++;
+            break;
+        }
+        case IrOp::store:
+        case IrOp::push:
+        case IrOp::exit:
+            inst.a = fn.resolve(inst.a);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // a store is dead when on every path from it the slot is stored again or the program exits before it is loaded
+    // blocks are visited backwards, each with the set of slots dead at its end, as a bit per slot for the first 64
+    // slots the function stores to, which is all of them in any statement of a usual size
+    void remove_dead_stores(IrFunction &fn, const std::span<const int64_t> dead_at_end)
+    {
+        m_slots.clear();
+        for (const IrInst &inst : fn.insts)
+        {
+            if (inst.op == IrOp::store && m_slots.size() < 64 && slot_index(inst.imm) == 0)
+            {
+                if (static_cast<size_t>(inst.imm) >= m_slot_index.size())
+                {
+                    m_slot_index.resize(static_cast<size_t>(inst.imm) + 1, 0);
+                }
+                m_slots.push_back(inst.imm);
+                m_slot_index[static_cast<size_t>(inst.imm)] = static_cast<uint8_t>(m_slots.size());
+            }
+        }
+        if (m_slots.empty())
+        {
+            return;
+        }
+        uint64_t dead_at_ret = 0;
+        for (const int64_t slot : dead_at_end)
+        {
+            const uint8_t index = slot_index(slot);
+            dead_at_ret |= index != 0 ? uint64_t{1} << (index - 1) : 0;
+        }
+        m_dead_at_begin.assign(fn.blocks.size(), 0);
+        for (IrBlockId id = static_cast<IrBlockId>(fn.blocks.size()); id-- > 0;)
+        {
+            const IrBlock &block = fn.blocks[id];
+            if (!block.live)
+            {
+                continue;
+            }
+            // every slot is dead once the program exits, when the statement ends the next ones may load it
+            uint64_t dead = 0;
+            switch (fn.terminator(block).op)
+            {
+            case IrOp::ret:
+                dead = dead_at_ret;
+                break;
+            case IrOp::exit:
+                dead = ~uint64_t{0};
+                break;
+            case IrOp::jmp:
+                dead = m_dead_at_begin[block.succ[0]];
+                break;
+            case IrOp::br:
+                dead = m_dead_at_begin[block.succ[0]] & m_dead_at_begin[block.succ[1]];
+                break;
+            default:
+                break;
+            }
+            for (uint32_t i = block.end; i-- > block.begin;)
+            {
+                IrInst &inst = fn.insts[i];
+                const uint8_t index = inst.op == IrOp::store || inst.op == IrOp::load ? slot_index(inst.imm) : 0;
+                if (index == 0)
+                {
+                    continue;
+                }
+                const uint64_t bit = uint64_t{1} << (index - 1);
+                if (inst.op == IrOp::load)
+                {
+                    dead &= ~bit;
+                }
+                else if ((dead & bit) != 0)
+                {
+                    m_removed.stores.push_back(inst.imm);
+                    inst = {IrOp::nop};
+                }
+                else
+                {
+                    dead |= bit;
+                }
+            }
+            m_dead_at_begin[id] = dead;
+        }
+        for (const int64_t slot : m_slots)
+        {
+            m_slot_index[static_cast<size_t>(slot)] = 0;
+        }
+    }
+
+    // index + 1 of a slot among the slots remove_dead_stores() tracks, 0 for one it does not
+    [[nodiscard]] uint8_t slot_index(const int64_t slot) const
+    {
+        return static_cast<size_t>(slot) < m_slot_index.size() ? m_slot_index[static_cast<size_t>(slot)] : 0;
+    }
+
+    // an instruction is used when it has an effect or a used instruction reads its value, every value is defined
+    // before it is read, so a single backward pass over the live blocks finds them all
+    // a division by a value that is not a constant is kept, it may fault whatever is done with the quotient
+    void remove_unused(IrFunction &fn)
+    {
+        m_used.assign(fn.insts.size(), false);
+        for (IrBlockId id = static_cast<IrBlockId>(fn.blocks.size()); id-- > 0;)
+        {
+            const IrBlock &block = fn.blocks[id];
+            if (!block.live)
+            {
+                continue;
+            }
+            for (uint32_t i = block.end; i-- > block.begin;)
+            {
+                IrInst &inst = fn.insts[i];
+                const bool effect = inst.type == IrType::none ||
+                                    ((inst.op == IrOp::udiv || inst.op == IrOp::urem) && fn.insts[inst.b].op != IrOp::constant);
+                if (!effect && !m_used[i])
+                {
+                    // constants, literals and copies emit no code of their own
+                    if (inst.op != IrOp::constant && inst.op != IrOp::lit && inst.op != IrOp::copy)
+                    {
+                        m_removed.insts++;
+                    }
+                    inst = {IrOp::nop};
+                    continue;
+                }
+                if (inst.op == IrOp::phi)
+                {
+                    const std::span<const IrValue> args = fn.args_of(inst, block);
+                    const std::span<const IrBlockId> preds = fn.preds_of(block);
+                    for (size_t k = 0; k < args.size(); k++)
+                    {
+                        if (fn.blocks[preds[k]].live)
+                        {
+                            m_used[args[k]] = true;
+                        }
+                    }
+                    continue;
+                }
+                for (const uint32_t operand : {inst.a, inst.b})
+                {
+                    if (operand != ir_none)
+                    {
+                        m_used[operand] = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // an operation with 0 or 1 as one operand that is the other operand is replaced by it, returns whether it was
+    // x + 0, 0 + x, x - 0, x * 1, 1 * x and x / 1 are x
+    // x * 0 and x % 1 are 0 but stay, a division by them is not known to divide by zero before the program runs
+    static bool simplify(const IrFunction &fn, IrInst &inst)
+    {
+        const auto is = [&](const IrValue value, const int64_t imm)
+        {
+            return fn.insts[value].op == IrOp::constant && fn.insts[value].imm == imm;
+        };
+        IrValue same = ir_none;
+        switch (inst.op)
+        {
+        case IrOp::add:
+            same = is(inst.b, 0) ? inst.a : is(inst.a, 0) ? inst.b : ir_none;
+            break;
+        case IrOp::sub:
+            same = is(inst.b, 0) ? inst.a : ir_none;
+            break;
+        case IrOp::mul:
+            same = is(inst.b, 1) ? inst.a : is(inst.a, 1) ? inst.b : ir_none;
+            break;
+        case IrOp::udiv:
+            same = is(inst.b, 1) ? inst.a : ir_none;
+            break;
+        default:
+            break;
+        }
+        if (same == ir_none)
+        {
+            return false;
+        }
+        inst = {IrOp::copy, IrType::i64, same};
+        return true;
+    }
+
+    Stats m_stats{};
+    Removed m_removed{};
+    std::vector<int64_t> m_slots{};          // stack slots tracked by remove_dead_stores()
+    std::vector<uint8_t> m_slot_index{};     // by stack slot, index + 1 into m_slots, 0 for none
+    std::vector<uint64_t> m_dead_at_begin{}; // by block, slots dead where it begins
+    std::vector<bool> m_used{};              // by instruction, whether it is used
+};
@@ -0,0 +1,501 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "./ir.hpp"
+#include "./machine.hpp"
+
+// turns the IR of a top-level statement into machine instructions on virtual registers
+// a value gets a virtual register where its instruction is, except constants and literals, which are moved into a
+// register next to every instruction that needs one there, so they do not hold a register in between
+// a phi is a virtual register the predecessors of its block move their argument into before they jump
+// the live blocks are written in layout order, a jump to the block right after it is left for the peephole pass
+// multiplication and division by a constant avoid the general instructions, see mul_by() and div_by()
+class InstructionSelector
+{
+
+public:
+    // unsigned division by d as a multiplication, the quotient of n is the high half of n * multiplier shifted right
+    // by shift, or when the multiplier takes 65 bits, ((n - high) / 2 + high) shifted right by shift
+    struct Magic
+    {
+        uint64_t multiplier;
+        uint32_t shift;
+        bool add;
+    };
+
+    // d is not a power of two
+    static Magic magic(const uint64_t d)
+    {
+        // 2^(64 + log) / d rounded up fits in 64 bits when the rounding error is small enough, else in 65
+        const auto log = static_cast<uint32_t>(63 - std::countl_zero(d));
+        const unsigned __int128 power = static_cast<unsigned __int128>(uint64_t{1} << log) << 64;
+        const auto multiplier = static_cast<uint64_t>(power / d);
+        const auto rem = static_cast<uint64_t>(power % d);
+        if (d - rem < (uint64_t{1} << log))
+        {
+            return {multiplier + 1, log, false};
+        }
+        // 2^(65 + log) / d rounded down is twice the quotient, rem is at most d - 2^log here, less than d / 2, so
+        // twice rem adds nothing to it
+        return {multiplier + multiplier + 1, log, true};
+    }
+
+    // appends the code of the live blocks of fn to out and returns the number of virtual registers it uses
+    // labels of blocks are numbered from label_count on, it is advanced past them
+    uint32_t select(const IrFunction &fn, size_t &label_count, std::vector<Inst> &out)
+    {
+        m_fn = &fn;
+        m_out = &out;
+        m_label_count = &label_count;
+        m_vreg.assign(fn.insts.size(), UINT32_MAX);
+        m_label.assign(fn.blocks.size(), UINT32_MAX);
+        m_phis_end.assign(fn.blocks.size(), UINT32_MAX);
+        m_vreg_count = 0;
+        count_uses();
+        const size_t first = out.size();
+        for (IrBlockId id = 0; id < fn.blocks.size(); id++)
+        {
+            const IrBlock &block = fn.blocks[id];
+            if (!block.live)
+            {
+                continue;
+            }
+            // every jump to a block comes before it, so its label is known to be needed by now
+            if (m_label[id] != UINT32_MAX)
+            {
+                emit(Op::label, {Operand::Kind::label, m_label[id]});
+            }
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                select_inst(id, i);
+            }
+        }
+        return renumber(first);
+    }
+
+private:
+    // how often each value is read by the instructions of live blocks, a value read once can be overwritten by the
+    // instruction reading it
+    void count_uses()
+    {
+        const IrFunction &fn = *m_fn;
+        m_uses.assign(fn.insts.size(), 0);
+        for (const IrBlock &block : fn.blocks)
+        {
+            if (!block.live)
+            {
+                continue;
+            }
+            for (uint32_t i = block.begin; i < block.end; i++)
+            {
+                const IrInst &inst = fn.insts[i];
+                if (inst.op == IrOp::phi)
+                {
+                    const std::span<const IrValue> args = fn.args_of(inst, block);
+                    const std::span<const IrBlockId> preds = fn.preds_of(block);
+                    for (size_t k = 0; k < args.size(); k++)
+                    {
+                        if (fn.blocks[preds[k]].live)
+                        {
+                            m_uses[fn.resolve(args[k])]++;
+                        }
+                    }
+                }
+                else if (inst.op != IrOp::copy)
+                {
+                    for (const uint32_t operand : {inst.a, inst.b})
+                    {
+                        if (operand != ir_none)
+                        {
+                            m_uses[fn.resolve(operand)]++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void select_inst(const IrBlockId id, const uint32_t i)
+    {
+        const IrFunction &fn = *m_fn;
+        const IrBlock &block = fn.blocks[id];
+        const IrInst &inst = fn.insts[i];
+        switch (inst.op)
+        {
+        case IrOp::constant:
+        case IrOp::lit:
+        case IrOp::phi:
+        case IrOp::copy:
+        case IrOp::nop:
+            // moved into place where they are used, or removed
+            break;
+        case IrOp::load:
+            emit(Op::mov, vreg_of(i), {Operand::Kind::slot, inst.imm});
+            break;
+        case IrOp::mul:
+            if (const std::optional<uint64_t> c = constant_of(inst.b))
+            {
+                mul_by(i, inst.a, *c);
+                break;
+            }
+            if (const std::optional<uint64_t> c = constant_of(inst.a))
+            {
+                mul_by(i, inst.b, *c);
+                break;
+            }
+            [[fallthrough]];
+        case IrOp::add:
+        case IrOp::sub:
+        {
+            const Operand dst = result(i, inst.a);
+            const Operand src = in_vreg(inst.b);
+            emit(inst.op == IrOp::add ? Op::add : inst.op == IrOp::sub ? Op::sub : Op::imul, dst, src); // low 64 bits of the product, the same as unsigned mul
+            break;
+        }
+        case IrOp::udiv:
+        case IrOp::urem:
+        {
+            if (const std::optional<uint64_t> d = constant_of(inst.b))
+            {
+                div_by(i, inst.op, inst.a, *d);
+                break;
+            }
+            // unsigned division of rdx:rax, the quotient is stored in rax and the remainder in rdx
+            const Operand dst = result(i, inst.a);
+            emit(Op::mov, Operand::reg_of(Reg::rax), dst);
+            emit(Op::xor_, Operand::reg_of(Reg::rdx), Operand::reg_of(Reg::rdx)); // setting rdx to 0
+            emit(Op::div, in_vreg(inst.b));
+            emit(Op::mov, dst, Operand::reg_of(inst.op == IrOp::udiv ? Reg::rax : Reg::rdx));
+            break;
+        }
+        case IrOp::store:
+            emit(Op::mov, {Operand::Kind::slot, inst.imm}, operand(inst.a));
+            break;
+        case IrOp::push:
+            // the generator pushes rax once the spill slots of the statement are released
+            emit(Op::mov, Operand::reg_of(Reg::rax), operand(inst.a));
+            break;
+        case IrOp::br:
+        {
+            const Operand cond = in_vreg(inst.a);
+            emit(Op::test, cond, cond);
+            emit(Op::jz, label(block.succ[1]));
+            if (next_live(id) != block.succ[0])
+            {
+                emit(Op::jmp, label(block.succ[0]));
+            }
+            break;
+        }
+        case IrOp::jmp:
+        {
+            // arguments of the phis of the target that come from this block, predecessors are in layout order
+            const IrBlock &target = fn.blocks[block.succ[0]];
+            const std::span<const IrBlockId> preds = fn.preds_of(target);
+            const size_t k = static_cast<size_t>(std::lower_bound(preds.begin(), preds.end(), id) - preds.begin());
+            for (uint32_t p = target.begin; p < phis_end(block.succ[0]); p++)
+            {
+                if (fn.insts[p].op == IrOp::phi)
+                {
+                    emit(Op::mov, vreg_of(p), operand(fn.args_of(fn.insts[p], target)[k]));
+                }
+            }
+            emit(Op::jmp, label(block.succ[0]));
+            break;
+        }
+        case IrOp::exit:
+            // the program ends here, so registers can be overwritten whatever they hold
+            emit(Op::mov, Operand::reg_of(Reg::rdi), operand(inst.a));   // value to be returned in rdi
+            emit(Op::mov, Operand::reg_of(Reg::rax), Operand::imm_of(60)); // code 60 for exit in rax
+            emit(Op::syscall);
+            break;
+        case IrOp::ret:
+            break;
+        }
+    }
+
+    // x * c, c is not 1, that is folded
+    // a power of two is a shift, 3, 5 and 9 are a lea, times a power of two or times each other, anything else
+    // fitting in 32 bits is multiplied as an immediate
+    void mul_by(const uint32_t i, const IrValue x, const uint64_t c)
+    {
+        assert(c != 1);
+        if (c == 0)
+        {
+            emit(Op::mov, vreg_of(i), Operand::imm_of(0));
+            return;
+        }
+        const auto shift = static_cast<uint32_t>(std::countr_zero(c));
+        const uint64_t odd = c >> shift;
+        const auto lea_scale = [](const uint64_t factor) -> int64_t
+        {
+            return factor == 3 || factor == 5 || factor == 9 ? static_cast<int64_t>(factor - 1) : 0;
+        };
+        if (odd == 1)
+        {
+            emit(Op::shl, result(i, x), Operand::imm_of(shift));
+            return;
+        }
+        if (const int64_t scale = lea_scale(odd); scale != 0)
+        {
+            const Operand src = in_vreg(x);
+            const Operand dst = destination(i, x);
+            emit(Op::lea, dst, src, scale);
+            if (shift != 0)
+            {
+                emit(Op::shl, dst, Operand::imm_of(shift));
+            }
+            return;
+        }
+        for (const uint64_t factor : {3, 5, 9})
+        {
+            if (shift == 0 && odd % factor == 0 && lea_scale(odd / factor) != 0)
+            {
+                const Operand src = in_vreg(x);
+                const Operand dst = destination(i, x);
+                emit(Op::lea, dst, src, lea_scale(factor));
+                emit(Op::lea, dst, dst, lea_scale(odd / factor));
+                return;
+            }
+        }
+        const auto imm = static_cast<int64_t>(c);
+        if (imm == static_cast<int32_t>(imm))
+        {
+            // the low half of the product is the same for the sign extended immediate
+            const Operand src = in_vreg(x);
+            emit(Op::imul3, destination(i, x), src, imm);
+            return;
+        }
+        const Operand dst = result(i, x);
+        emit(Op::imul, dst, load(Operand::imm_of(imm)));
+    }
+
+    // x / d or x % d, d is not 0, which is an error, x / 1 is folded
+    // a power of two is a shift or a mask, anything else a multiplication by magic(d)
+    void div_by(const uint32_t i, const IrOp op, const IrValue x, const uint64_t d)
+    {
+        assert(d > 1 || (d == 1 && op == IrOp::urem));
+        if (std::has_single_bit(d))
+        {
+            if (op == IrOp::udiv)
+            {
+                emit(Op::shr, result(i, x), Operand::imm_of(std::countr_zero(d)));
+            }
+            else
+            {
+                emit(Op::and_, result(i, x), Operand::imm_of(static_cast<int64_t>(d - 1)));
+            }
+            return;
+        }
+        const Magic m = magic(d);
+        const Operand rax = Operand::reg_of(Reg::rax);
+        const Operand rdx = Operand::reg_of(Reg::rdx);
+        const Operand n = in_vreg(x);
+        emit(Op::mov, rax, Operand::imm_of(static_cast<int64_t>(m.multiplier)));
+        emit(Op::mul, n); // high half of the product in rdx
+        const Operand quotient = op == IrOp::udiv ? vreg_of(i) : Operand::vreg_of(m_vreg_count++);
+        if (m.add)
+        {
+            emit(Op::mov, quotient, n);
+            emit(Op::sub, quotient, rdx);
+            emit(Op::shr, quotient, Operand::imm_of(1));
+            emit(Op::add, quotient, rdx);
+            emit(Op::shr, quotient, Operand::imm_of(m.shift));
+        }
+        else
+        {
+            emit(Op::shr, rdx, Operand::imm_of(m.shift));
+            emit(Op::mov, quotient, rdx);
+        }
+        if (op == IrOp::udiv)
+        {
+            return;
+        }
+        // the remainder is x - quotient * d
+        const auto imm = static_cast<int64_t>(d);
+        if (imm == static_cast<int32_t>(imm))
+        {
+            emit(Op::imul3, quotient, quotient, imm);
+        }
+        else
+        {
+            emit(Op::imul, quotient, load(Operand::imm_of(imm)));
+        }
+        emit(Op::sub, result(i, x), quotient);
+    }
+
+    // the value of a constant
+    [[nodiscard]] std::optional<uint64_t> constant_of(const IrValue value) const
+    {
+        const IrInst &inst = m_fn->insts[m_fn->resolve(value)];
+        if (inst.op != IrOp::constant)
+        {
+            return std::nullopt;
+        }
+        return static_cast<uint64_t>(inst.imm);
+    }
+
+    // virtual register of the value an instruction defines, given out on first use
+    Operand vreg_of(const IrValue value)
+    {
+        if (m_vreg[value] == UINT32_MAX)
+        {
+            m_vreg[value] = m_vreg_count++;
+        }
+        return Operand::vreg_of(m_vreg[value]);
+    }
+
+    // a value as an operand, constants and literals as immediates
+    Operand operand(IrValue value)
+    {
+        value = m_fn->resolve(value);
+        const IrInst &inst = m_fn->insts[value];
+        if (inst.op == IrOp::constant)
+        {
+            return Operand::imm_of(inst.imm);
+        }
+        if (inst.op == IrOp::lit)
+        {
+            return {Operand::Kind::lit, inst.imm};
+        }
+        return vreg_of(value);
+    }
+
+    // a value in a virtual register, constants and literals are moved into a new one, the peephole pass puts them
+    // back into the instructions that take them
+    Operand in_vreg(const IrValue value)
+    {
+        const Operand o = operand(value);
+        if (o.kind == Operand::Kind::vreg)
+        {
+            return o;
+        }
+        return load(o);
+    }
+
+    // a new virtual register holding o
+    Operand load(const Operand o)
+    {
+        const Operand loaded = Operand::vreg_of(m_vreg_count++);
+        emit(Op::mov, loaded, o);
+        return loaded;
+    }
+
+    // register the result of instruction i goes into, computed in place of its first operand lhs
+    // the register of lhs is reused when nothing else reads it, otherwise lhs is copied into a new one
+    Operand result(const uint32_t i, IrValue lhs)
+    {
+        if (reusable(lhs))
+        {
+            return destination(i, lhs);
+        }
+        const Operand value = operand(lhs);
+        const Operand dst = vreg_of(i);
+        emit(Op::mov, dst, value);
+        return dst;
+    }
+
+    // register the result of instruction i goes into when it is computed from lhs without being built up in place,
+    // the register of lhs when nothing else reads it
+    Operand destination(const uint32_t i, IrValue lhs)
+    {
+        lhs = m_fn->resolve(lhs);
+        if (reusable(lhs))
+        {
+            const Operand dst = vreg_of(lhs);
+            m_vreg[i] = m_vreg[lhs];
+            return dst;
+        }
+        return vreg_of(i);
+    }
+
+    // whether the register of a value can be overwritten by the only instruction reading it
+    [[nodiscard]] bool reusable(IrValue value) const
+    {
+        value = m_fn->resolve(value);
+        const IrOp op = m_fn->insts[value].op;
+        return m_uses[value] == 1 && op != IrOp::constant && op != IrOp::lit;
+    }
+
+    // end of the phis at the start of a block, folded and removed phis among them included
+    uint32_t phis_end(const IrBlockId id)
+    {
+        if (m_phis_end[id] == UINT32_MAX)
+        {
+            const IrBlock &block = m_fn->blocks[id];
+            uint32_t end = block.begin;
+            while (end < block.end && (m_fn->insts[end].op == IrOp::phi || m_fn->insts[end].op == IrOp::copy ||
+                                       m_fn->insts[end].op == IrOp::constant || m_fn->insts[end].op == IrOp::nop))
+            {
+                end++;
+            }
+            m_phis_end[id] = end;
+        }
+        return m_phis_end[id];
+    }
+
+    Operand label(const IrBlockId block)
+    {
+        if (m_label[block] == UINT32_MAX)
+        {
+            m_label[block] = static_cast<uint32_t>((*m_label_count)++);
+        }
+        return {Operand::Kind::label, m_label[block]};
+    }
+
+    // first live block after block id
+    [[nodiscard]] IrBlockId next_live(IrBlockId id) const
+    {
+        do
+        {
+            id++;
+        } while (id < m_fn->blocks.size() && !m_fn->blocks[id].live);
+        return id;
+    }
+
+    void emit(const Op op, const Operand dst = {}, const Operand src = {}, const int64_t imm = 0)
+    {
+        m_out->push_back({op, dst, src, imm});
+    }
+
+    // numbers the virtual registers of the code from first on in the order they appear, which register allocation
+    // relies on, and returns how many there are
+    uint32_t renumber(const size_t first)
+    {
+        m_renumbered.assign(m_vreg_count, UINT32_MAX);
+        uint32_t count = 0;
+        for (size_t i = first; i < m_out->size(); i++)
+        {
+            Inst &inst = (*m_out)[i];
+            for (Operand *o : {&inst.dst, &inst.src})
+            {
+                if (o->kind != Operand::Kind::vreg)
+                {
+                    continue;
+                }
+                uint32_t &number = m_renumbered[o->value];
+                if (number == UINT32_MAX)
+                {
+                    number = count++;
+                }
+                o->value = number;
+            }
+        }
+        return count;
+    }
+
+    const IrFunction *m_fn = nullptr;
+    std::vector<Inst> *m_out = nullptr;
+    size_t *m_label_count = nullptr;
+    std::vector<uint32_t> m_vreg;       // by value, its virtual register
+    std::vector<uint32_t> m_uses;       // by value, how often live instructions read it
+    std::vector<uint32_t> m_label;      // by block, its label number
+    std::vector<uint32_t> m_phis_end;   // by block, end of its phis once looked up
+    std::vector<uint32_t> m_renumbered; // by virtual register, its number in order of appearance
+    uint32_t m_vreg_count = 0;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <csetjmp>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <string_view>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "./encoder.hpp"
+
+// runs encoded machine code in the compiler's own process, for --run
+// the code is copied to memory mapped executable, the syscall it ends the program with is encoded as a call to
+// syscall_handler(), which jumps back to run() with the exit status instead of ending the process
+class JitProgram
+{
+
+public:
+    explicit JitProgram(const std::span<const uint8_t> code)
+        : m_size(code.size())
+    {
+        // writable to copy the code in, then executable and no longer writable
+        void *memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            std::cerr << "Unable to map memory for the program" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        m_code = static_cast<uint8_t *>(memory);
+        std::memcpy(m_code, code.data(), m_size);
+        if (mprotect(m_code, m_size, PROT_READ | PROT_EXEC) != 0)
+        {
+            std::cerr << "Unable to make the program executable" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    JitProgram(const JitProgram &) = delete;
+    JitProgram &operator=(const JitProgram &) = delete;
+
+    ~JitProgram()
+    {
+        munmap(m_code, m_size);
+    }
+
+    // address for X86Encoder::set_syscall_handler()
+    static uint64_t syscall_handler_address()
+    {
+        return reinterpret_cast<uint64_t>(&syscall_handler);
+    }
+
+    // runs the program to its end and returns its exit status as a process would have it
+    // the program only touches the stack below the call, and callee-saved registers are restored by longjmp
+    [[nodiscard]] int run() const
+    {
+        if (setjmp(s_exit) == 0)
+        {
+            reinterpret_cast<void (*)()>(m_code)();
+        }
+        return static_cast<int>(s_status & 0xFF);
+    }
+
+    // writes /tmp/perf-<pid>.map, which perf reads symbols of code without an object file from, for --perf-map
+    // each top-level statement is a symbol named after the source and its position in it, as --emit-ir numbers them
+    void write_perf_map(const std::string_view source, const std::span<const X86Encoder::Region> regions) const
+    {
+        const std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        std::ofstream map(path, std::ios::out | std::ios::trunc);
+        for (size_t i = 0; i < regions.size(); i++)
+        {
+            const size_t end = i + 1 < regions.size() ? regions[i + 1].offset : m_size;
+            if (end == regions[i].offset)
+            {
+                continue;
+            }
+            map << std::hex << reinterpret_cast<uintptr_t>(m_code + regions[i].offset) << " " << end - regions[i].offset
+                << std::dec << " " << source;
+            if (regions[i].statement == 0)
+            {
+                map << " exit\n";
+            }
+            else
+            {
+                map << " statement " << regions[i].statement << "\n";
+            }
+        }
+        if (!map)
+        {
+            std::cerr << "Unable to write file: " << path << std::endl;
+        }
+    }
+
+private:
+    // called by the program in place of a syscall, with its arguments
+    // exit is the only syscall the generated code makes
+    [[noreturn]] static void syscall_handler(const uint64_t arg, const uint64_t number)
+    {
+        if (number != 60)
+        {
+            std::cerr << "Unsupported system call " << number << std::endl;
+            std::abort();
+        }
+        s_status = arg;
+        std::longjmp(s_exit, 1);
+    }
+
+    uint8_t *m_code;
+    size_t m_size;
+
+    static inline std::jmp_buf s_exit{}; // where run() waits for the program to end
+    static inline uint64_t s_status = 0; // exit status the program ended with
+};
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "./asm_writer.hpp"
+#include "./string_table.hpp"
+
+// x86-64 general purpose registers, numbered as in instruction encodings
+enum class Reg : uint8_t
+{
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15,
+};
+
+inline std::string_view to_string(const Reg reg)
+{
+    static constexpr std::array<std::string_view, 16> names = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+    return names[static_cast<size_t>(reg)];
+}
+
+// operand of a machine instruction
+// code is generated with virtual registers and stack slots of variables, register allocation turns them into
+// registers and rsp relative memory
+struct Operand
+{
+    enum class Kind : uint8_t
+    {
+        none,
+        reg,   // physical register
+        vreg,  // virtual register
+        imm,   // immediate value
+        lit,   // literal written as in the source, value is its string id
+        slot,  // stack slot of a variable, value is the stack depth that counts it, as in Generator::Var::stack_loc
+        mem,   // QWORD [rsp + value]
+        label, // label number
+    };
+
+    Kind kind = Kind::none;
+    int64_t value = 0;
+
+    static Operand reg_of(const Reg reg)
+    {
+        return {Kind::reg, static_cast<int64_t>(reg)};
+    }
+
+    static Operand vreg_of(const uint32_t vreg)
+    {
+        return {Kind::vreg, vreg};
+    }
+
+    static Operand imm_of(const int64_t imm)
+    {
+        return {Kind::imm, imm};
+    }
+
+    [[nodiscard]] Reg reg() const
+    {
+        return static_cast<Reg>(value);
+    }
+
+    [[nodiscard]] bool is(const Reg r) const
+    {
+        return kind == Kind::reg && reg() == r;
+    }
+
+    bool operator==(const Operand &) const = default;
+};
+
+enum class Op : uint8_t
+{
+    mov,
+    add,
+    sub,
+    imul,  // dst = dst * src, the low half of the product is the same signed or unsigned
+    imul3, // dst = src * imm, imm is sign extended from 32 bits
+    mul,   // unsigned rdx:rax = rax * dst, the high half of the product in rdx
+    div,   // unsigned rdx:rax / dst, quotient in rax and remainder in rdx
+    lea,   // dst = src + src * imm, imm is 1, 2, 4 or 8
+    shl,   // dst = dst << src, src is an immediate
+    shr,   // dst = dst >> src, unsigned
+    and_,
+    xor_,
+    test,
+    push,
+    pop,
+    jz,
+    jmp,
+    label,
+    syscall,
+};
+
+// one instruction, dst is also the only operand of single operand instructions
+struct Inst
+{
+    Op op;
+    Operand dst{};
+    Operand src{};
+    int64_t imm = 0; // third operand of imul3 and lea
+    bool operator==(const Inst &) const = default;
+};
+
+// writes an instruction in the syntax of yasm and nasm
+inline void write_inst(AsmWriter &out, const Inst &inst, const StringTable &strings)
+{
+    const auto operand = [&](const Operand &o)
+    {
+        switch (o.kind)
+        {
+        case Operand::Kind::reg:
+            out << to_string(o.reg());
+            break;
+        case Operand::Kind::imm:
+            out << o.value;
+            break;
+        case Operand::Kind::lit:
+        {
+            // a float literal may start with its point
+            const std::string_view lit = strings.text(static_cast<uint32_t>(o.value));
+            out << (!lit.empty() && lit.front() == '.' ? "0" : "") << lit;
+            break;
+        }
+        case Operand::Kind::mem:
+            out << "QWORD [rsp + " << o.value << "]";
+            break;
+        case Operand::Kind::label:
+            out << "label" << o.value;
+            break;
+        default:
+            // virtual registers and slots never reach the output
+            out << "?";
+        }
+    };
+    const auto binary = [&](const std::string_view name)
+    {
+        out << "    " << name << " ";
+        operand(inst.dst);
+        out << ", ";
+        operand(inst.src);
+        out << "\n";
+    };
+    const auto unary = [&](const std::string_view name)
+    {
+        out << "    " << name << " ";
+        operand(inst.dst);
+        out << "\n";
+    };
+    switch (inst.op)
+    {
+    case Op::mov:
+        binary("mov");
+        break;
+    case Op::add:
+        binary("add");
+        break;
+    case Op::sub:
+        binary("sub");
+        break;
+    case Op::imul:
+        binary("imul");
+        break;
+    case Op::imul3:
+        out << "    imul ";
+        operand(inst.dst);
+        out << ", ";
+        operand(inst.src);
+        out << ", " << inst.imm << "\n";
+        break;
+    case Op::mul:
+        unary("mul");
+        break;
+    case Op::div:
+        unary("div");
+        break;
+    case Op::lea:
+        out << "    lea ";
+        operand(inst.dst);
+        out << ", [";
+        operand(inst.src);
+        out << " + ";
+        operand(inst.src);
+        out << "*" << inst.imm << "]\n";
+        break;
+    case Op::shl:
+        binary("shl");
+        break;
+    case Op::shr:
+        binary("shr");
+        break;
+    case Op::and_:
+        binary("and");
+        break;
+    case Op::xor_:
+        binary("xor");
+        break;
+    case Op::test:
+        binary("test");
+        break;
+    case Op::push:
+        unary("push");
+        break;
+    case Op::pop:
+        unary("pop");
+        break;
+    case Op::jz:
+        unary("jz");
+        break;
+    case Op::jmp:
+        unary("jmp");
+        break;
+    case Op::label:
+        operand(inst.dst);
+        out << ":\n";
+        break;
+    case Op::syscall:
+        out << "    syscall\n";
+        break;
+    }
+}
@@ -1,57 +1,494 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iomanip>
+#include <sstream>
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "./ast_cache.hpp"
+#include "./elf.hpp"
 #include "./generator.hpp"
+#include "./jit.hpp"
+#include "./vm.hpp"
+#include "./source.hpp"
+#include "./watch.hpp"
+
+// heap allocations made so far, reported by --stats
+static std::atomic<size_t> heap_allocations{0};
+
+void *operator new(const size_t size)
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+    {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+// time and heap allocations of one phase of the compiler, printed by --stats
+class PhaseStats
+{
+
+public:
+    explicit PhaseStats(const char *name)
+        : m_name(name)
+    {
+    }
+
+    // tokens is 0 when the phase has no tokens to relate to
+    void report(const size_t tokens) const
+    {
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_start).count();
+        const size_t allocations = heap_allocations - m_allocations;
+        std::stringstream line;
+        line << std::fixed << std::setprecision(3) << "[stats] " << m_name << ": " << ms << " ms, " << allocations
+             << " heap allocations";
+        if (tokens != 0)
+        {
+            line << " (" << static_cast<double>(allocations) / static_cast<double>(tokens) << " per token)";
+        }
+        std::cerr << line.str() << std::endl;
+    }
+
+private:
+    const char *m_name;
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+    size_t m_allocations = heap_allocations;
+};
+
+// assembles out.asm and links it into the executable out
+void assemble()
+{
+    // generating object code by assember - nasm
+    // system("nasm -felf64 out.asm")
+
+    // generating object code by assembler - yasm (gives .lst file for examining text segment)
+    system("yasm -felf64 -g dwarf2 -l out.lst out.asm");
+
+    // linking object code gives executable
+    system("ld out.o -o out");
+}
+
+// writes the assembly code to out.asm, assembles and links it
+void build(const std::string &code)
+{
+    // transferring assembly code to file out.asm
+    {
+        std::fstream file("out.asm", std::ios::out);
+        file << code;
+    }
+    assemble();
+}
+
+// links machine code into the executable out
+void write_executable(const std::span<const uint8_t> code)
+{
+    write_file("out", ElfExecutableWriter().write(code), 0755);
+}
+
+// out.asm, written while the program is generated
+// the text goes to an unnamed file in the current directory that only becomes out.asm once complete, if the compiler
+// exits before that it disappears and the last out.asm is left alone as before
+// file systems without unnamed files get out.asm itself
+class AsmFile
+{
+
+public:
+    AsmFile()
+    {
+        m_fd = open(".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+        m_unnamed = m_fd >= 0;
+        if (!m_unnamed)
+        {
+            m_fd = open("out.asm", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        if (m_fd < 0)
+        {
+            std::cerr << "Unable to open file: out.asm" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    AsmFile(const AsmFile &) = delete;
+    AsmFile &operator=(const AsmFile &) = delete;
+
+    [[nodiscard]] int fd() const
+    {
+        return m_fd;
+    }
+
+    // names the complete file out.asm and closes it
+    void commit()
+    {
+        if (m_unnamed)
+        {
+            const std::string proc = "/proc/self/fd/" + std::to_string(m_fd);
+            unlink("out.asm");
+            if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, "out.asm", AT_SYMLINK_FOLLOW) != 0)
+            {
+                std::cerr << "Unable to create file: out.asm" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        close(m_fd);
+    }
+
+private:
+    int m_fd;
+    bool m_unnamed; // whether m_fd has no name yet
+};
+
+// compiles the program to machine code and to bytecode, runs both in process and reports how long each takes, for
+// --bench, the runs are repeated and the fastest is reported, the exit status is the program's if both agree on it
+int benchmark(const NodeProg &prog, const StringTable &strings)
+{
+    constexpr int runs = 10;
+    using Clock = std::chrono::steady_clock;
+    const auto ms = [](const Clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    };
+
+    Clock::time_point start = Clock::now();
+    X86Encoder encoder(strings);
+    encoder.set_syscall_handler(JitProgram::syscall_handler_address());
+    Generator native(prog, strings);
+    native.set_encoder(&encoder);
+    native.gen_prog();
+    encoder.finish();
+    const JitProgram program(encoder.code());
+    const double native_compile = ms(start);
+
+    start = Clock::now();
+    BytecodeCompiler compiler(strings);
+    Generator interpreted(prog, strings);
+    interpreted.set_bytecode(&compiler);
+    interpreted.gen_prog();
+    const Bytecode bytecode = compiler.finish();
+    const double vm_compile = ms(start);
+
+    double native_run = 0;
+    double vm_run = 0;
+    int native_status = 0;
+    int vm_status = 0;
+    for (int i = 0; i < runs; i++)
+    {
+        start = Clock::now();
+        native_status = program.run();
+        native_run = i == 0 ? ms(start) : std::min(native_run, ms(start));
+        start = Clock::now();
+        vm_status = run_bytecode(bytecode);
+        vm_run = i == 0 ? ms(start) : std::min(vm_run, ms(start));
+    }
+
+    std::stringstream report;
+    report << std::fixed << std::setprecision(3);
+    report << "[bench] native: compile " << native_compile << " ms, run " << native_run << " ms, exit " << native_status
+           << ", " << encoder.code().size() << " bytes of code\n";
+    report << "[bench] vm: compile " << vm_compile << " ms, run " << vm_run << " ms, exit " << vm_status << ", "
+           << bytecode.code.size() << " instructions, " << bytecode.registers.size() << " registers\n";
+    report << std::setprecision(2) << "[bench] vm / native: compile " << vm_compile / native_compile << "x, run "
+           << vm_run / native_run << "x, compile and run " << (vm_compile + vm_run) / (native_compile + native_run)
+           << "x";
+    std::cerr << report.str() << std::endl;
+    if (native_status != vm_status)
+    {
+        std::cerr << "[bench] exit status differs between native code and bytecode" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return native_status;
+}
 
 int main(int argc, char *argv[])
 {
-    // argument to the executable is .blu file
-    if (argc != 2)
+    // argument to the executable is .blu file, preceded by options
+    // --watch rebuilds it every time it is saved, with --emit-asm as below
+    // --stats reports time and allocations of each phase
+    // --cache reuses the parse tree of an unchanged source from .blue-cache and saves it otherwise
+    // --emit-ir prints the optimized IR of every top-level statement, --dce-report lists the code removed as dead
+    // --emit-asm writes the program as assembly to out.asm and assembles and links it with yasm and ld instead of
+    // encoding and linking it in process, --emit-obj also writes the encoded program as the object file out.o
+    // --run runs the program in process instead of writing it out and exits with its exit status, --perf-map also
+    // writes its symbols for perf to /tmp/perf-<pid>.map, which stays there after the run for perf to read
+    // --vm does the same with the program lowered to bytecode and interpreted, --bench runs it both ways and compares
+    bool watch = false;
+    bool stats = false;
+    bool cache = false;
+    bool emit_ir = false;
+    bool dce_report = false;
+    bool emit_asm = false;
+    bool emit_obj = false;
+    bool run = false;
+    bool perf_map = false;
+    bool vm = false;
+    bool bench = false;
+    int arg = 1;
+    for (; arg < argc - 1; arg++)
+    {
+        if (std::strcmp(argv[arg], "--watch") == 0)
+        {
+            watch = true;
+        }
+        else if (std::strcmp(argv[arg], "--stats") == 0)
+        {
+            stats = true;
+        }
+        else if (std::strcmp(argv[arg], "--cache") == 0)
+        {
+            cache = true;
+        }
+        else if (std::strcmp(argv[arg], "--emit-ir") == 0)
+        {
+            emit_ir = true;
+        }
+        else if (std::strcmp(argv[arg], "--dce-report") == 0)
+        {
+            dce_report = true;
+        }
+        else if (std::strcmp(argv[arg], "--emit-asm") == 0)
+        {
+            emit_asm = true;
+        }
+        else if (std::strcmp(argv[arg], "--emit-obj") == 0)
+        {
+            emit_obj = true;
+        }
+        else if (std::strcmp(argv[arg], "--run") == 0)
+        {
+            run = true;
+        }
+        else if (std::strcmp(argv[arg], "--perf-map") == 0)
+        {
+            perf_map = true;
+        }
+        else if (std::strcmp(argv[arg], "--vm") == 0)
+        {
+            vm = true;
+        }
+        else if (std::strcmp(argv[arg], "--bench") == 0)
+        {
+            bench = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    // code run in process calls back into the compiler, it is not written out
+    const int modes = static_cast<int>(run) + static_cast<int>(vm) + static_cast<int>(bench);
+    if (arg != argc - 1 || modes > 1 || (modes == 1 && (emit_asm || emit_obj)) || (perf_map && !run))
     {
         std::cerr << "Incorrect usage. Correct usage ... " << std::endl;
         std::cerr << "blue <input.blu>" << std::endl;
+        std::cerr << "blue --watch [--emit-asm] <input.blu>" << std::endl;
+        std::cerr << "blue [--stats] [--cache] [--emit-ir] [--dce-report] [--emit-asm] [--emit-obj] <input.blu>" << std::endl;
+        std::cerr << "blue --run [--perf-map] [--stats] [--cache] [--emit-ir] [--dce-report] <input.blu>" << std::endl;
+        std::cerr << "blue --vm [--stats] [--cache] [--emit-ir] [--dce-report] <input.blu>" << std::endl;
+        std::cerr << "blue --bench [--cache] <input.blu>" << std::endl;
         exit(EXIT_FAILURE);
     }
+    const char *path = argv[arg];
 
-    // transferring file content into stringstream then to string
-    std::string contents;
+    if (watch && emit_asm)
     {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
+        WatchSession session(path, build);
+        session.run();
+    }
+    if (watch)
+    {
+        WatchSession session(path, write_executable);
+        session.run();
     }
 
-    // tokenising each string or symbol
-    Tokenizer tokenizer(std::move(contents));
-    std::vector<Token> tokens = tokenizer.tokenize();
+    // mapping the file, tokens, parse tree and generator all view into it so it lives until the end
+    const SourceFile source(path);
 
-    // generating parse tree
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> prog = parser.parse_prog();
+    // a cached tree of the same source skips tokenising and parsing
+    std::optional<AstCache> ast_cache;
+    std::optional<NodeProg> prog;
+    if (cache)
+    {
+        const PhaseStats load_stats("cache load");
+        ast_cache.emplace(source.view());
+        prog = ast_cache->load();
+        if (stats && prog.has_value())
+        {
+            load_stats.report(0);
+        }
+    }
 
+    std::optional<TokenStream> tokens;
+    std::optional<Parser> parser;
     if (!prog.has_value())
     {
-        std::cerr << "No statement found" << std::endl;
-        exit(EXIT_FAILURE);
-    }
+        // tokenising each string or symbol
+        const PhaseStats lex_stats("lex");
+        Tokenizer tokenizer(source.view());
+        tokens.emplace(tokenizer.tokenize());
+        if (stats)
+        {
+            lex_stats.report(tokens->size());
+        }
 
-    // generating assembly code
-    Generator generator(std::move(prog.value()));
+        // generating parse tree
+        const PhaseStats parse_stats("parse");
+        parser.emplace(tokens.value());
+        prog = parser->parse_prog();
+        if (stats)
+        {
+            parse_stats.report(tokens->size());
+            const ArenaAllocator::Stats &arena = parser->arena_stats();
+            std::cerr << "[stats] parse tree: " << tokens->size() << " tokens, " << arena.allocations << " nodes in "
+                      << arena.high_water << " bytes (" << arena.blocks << " blocks, " << arena.alignment_waste
+                      << " bytes of padding), " << parser->exprs().size() << " expression nodes in "
+                      << parser->exprs().size_bytes() << " bytes" << std::endl;
+        }
 
-    // transferring assembly code to file out.asm
+        if (!prog.has_value())
+        {
+            std::cerr << "No statement found" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (ast_cache.has_value())
+        {
+            ast_cache->save(prog.value(), parser->exprs(), tokens->strings());
+        }
+    }
+
+    const StringTable &strings = tokens.has_value() ? tokens->strings() : ast_cache->strings();
+    if (bench)
     {
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
+        return benchmark(prog.value(), strings);
     }
 
-    // generating object code by assember - nasm
-    // system("nasm -felf64 out.asm")
+    // generating machine code or bytecode, or assembly code straight into out.asm
+    const PhaseStats generate_stats("generate");
+    std::optional<AsmFile> asm_file;
+    X86Encoder encoder(strings);
+    BytecodeCompiler compiler(strings);
+    if (emit_asm)
+    {
+        asm_file.emplace();
+    }
+    Generator generator(std::move(prog.value()), strings, emit_asm ? asm_file->fd() : -1);
+    if (vm)
+    {
+        generator.set_bytecode(&compiler);
+    }
+    else if (!emit_asm)
+    {
+        generator.set_encoder(&encoder);
+    }
+    if (run)
+    {
+        encoder.set_syscall_handler(JitProgram::syscall_handler_address());
+    }
+    if (emit_ir)
+    {
+        generator.set_ir_output(&std::cout);
+    }
+    if (dce_report)
+    {
+        generator.set_dce_report(&std::cerr);
+    }
+    generator.gen_prog();
+    if (emit_asm)
+    {
+        asm_file->commit();
+    }
+    if (stats)
+    {
+        generate_stats.report(tokens.has_value() ? tokens->size() : 0);
+        const IrOptimizer::Stats &ir = generator.ir_stats();
+        std::cerr << "[stats] ir: " << ir.insts << " instructions, " << ir.folded << " folded, " << ir.dead_blocks
+                  << " dead blocks" << std::endl;
+        const Generator::DceStats &dce = generator.dce_stats();
+        std::cerr << "[stats] dce: " << ir.dead_insts << " unused instructions, " << ir.dead_stores << " dead stores, "
+                  << dce.slots << " variables without a stack slot, " << dce.unreachable << " unreachable statements"
+                  << std::endl;
+        const RegisterAllocator::Stats &registers = generator.alloc_stats();
+        std::cerr << "[stats] registers: " << registers.vregs << " virtual registers, " << registers.spilled
+                  << " spilled, " << registers.insts << " instructions" << std::endl;
+        std::cerr << "[stats] peephole:";
+        for (const Peephole::Rule &rule : generator.peephole_rules())
+        {
+            std::cerr << " " << rule.name << " " << rule.hits;
+        }
+        std::cerr << std::endl;
+    }
+    if (emit_asm)
+    {
+        assemble();
+        return EXIT_SUCCESS;
+    }
+    if (vm)
+    {
+        const Bytecode bytecode = compiler.finish();
+        if (stats)
+        {
+            const BytecodeCompiler::Stats &lowered = compiler.stats();
+            std::cerr << "[stats] bytecode: " << bytecode.code.size() << " instructions, " << bytecode.registers.size()
+                      << " registers (" << lowered.temporaries << " temporaries, " << lowered.constants
+                      << " constants, " << lowered.variables << " variables), fused " << lowered.fused_loads
+                      << " loads " << lowered.fused_stores << " stores " << lowered.fused_branches << " branches"
+                      << std::endl;
+        }
+        const PhaseStats run_stats("run");
+        const int status = run_bytecode(bytecode);
+        if (stats)
+        {
+            run_stats.report(0);
+        }
+        return status;
+    }
 
-    // generating object code by assembler - yasm (gives .lst file for examining text segment)
-    system("yasm -felf64 -g dwarf2 -l out.lst out.asm");
+    encoder.finish();
+    if (run)
+    {
+        const JitProgram program(encoder.code());
+        if (perf_map)
+        {
+            program.write_perf_map(path, encoder.regions());
+        }
+        const PhaseStats run_stats("run");
+        const int status = program.run();
+        if (stats)
+        {
+            run_stats.report(0);
+        }
+        return status;
+    }
 
-    // linking object code gives executable
-    system("ld out.o -o out");
+    // linking the machine code into the executable out, and writing it as an object file if asked
+    const PhaseStats link_stats("link");
+    if (emit_obj)
+    {
+        ElfObjectWriter object;
+        write_file("out.o", object.write(encoder.code(), encoder.labels()));
+    }
+    const std::vector<uint8_t> executable = ElfExecutableWriter().write(encoder.code());
+    write_file("out", executable, 0755);
+    if (stats)
+    {
+        link_stats.report(0);
+        std::cerr << "[stats] code: " << encoder.code().size() << " bytes of code, " << encoder.labels().size()
+                  << " labels, " << executable.size() << " bytes of executable" << std::endl;
+    }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
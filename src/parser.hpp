@@ -2,7 +2,9 @@
 
 #include <optional>
 #include <iostream>
+#include <span>
 #include <variant>
+#include <vector>
 
 #include "./arena.hpp"
 #include "./tokenization.hpp"
@@ -14,97 +16,65 @@ enum class DataType
     _float,
 };
 
-struct NodeTermIntLit
+// operation of an expression node, leaves are literals and identifiers, the rest combine two operands
+enum class ExprOp : uint8_t
 {
-    Token int_lit;
+    int_lit,
+    char_lit,
+    float_lit,
+    ident,
+    add,
+    sub,
+    mul,
+    div,
+    mod,
 };
 
-struct NodeTermCharLit
+inline bool is_leaf(const ExprOp op)
 {
-    Token char_lit;
-};
-
-struct NodeTermFloatLit
-{
-    Token float_lit;
-};
-
-struct NodeTermIdent
-{
-    Token ident;
-};
+    return op <= ExprOp::ident;
+}
 
-struct NodeExpr;
-
-struct NodeTermParen
-{
-    NodeExpr *expr;
-};
-
-struct NodeBinExprAdd
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExprSub
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExprMul
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExprDiv
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
-
-struct NodeBinExprMod
-{
-    NodeExpr *lhs;
-    NodeExpr *rhs;
-};
+using ExprId = uint32_t;
 
-// Binary expressions consists of two expressions
-struct NodeBinExpr
+// expressions of a parser live in one contiguous pool and refer to their operands by index into it
+// operands always come before the node that uses them, parentheses leave no node of their own
+struct NodeExpr
 {
-    std::variant<NodeBinExprAdd *, NodeBinExprMul *, NodeBinExprSub *, NodeBinExprDiv *, NodeBinExprMod *> var;
+    ExprOp op;
+    uint32_t lhs; // left operand, or the string id of the text of a leaf
+    ExprId rhs;   // right operand
 };
 
-// Term can be an integer literal, an identifier or an expression
-struct NodeTerm
+// root of an expression and the pool it lives in
+struct ExprRef
 {
-    std::variant<NodeTermIntLit *, NodeTermCharLit *, NodeTermFloatLit *, NodeTermIdent *, NodeTermParen *> var;
+    const NodeExpr *pool = nullptr;
+    ExprId root = 0;
 };
 
-// Expression can be a term or binary expression
-struct NodeExpr
+struct NodeTermIdent
 {
-    std::variant<NodeTerm *, NodeBinExpr *> var;
+    Token ident;
 };
 
 struct NodeStmtExit
 {
-    NodeExpr *expr;
+    ExprRef expr;
 };
 
 struct NodeStmtLet
 {
     Token ident;
-    NodeExpr *expr{};
+    ExprRef expr{};
 };
 
 struct NodeStmt;
 
+// sequences in nodes are spans into the arena, so the whole tree goes away with it
 struct NodeScope
 {
-    std::vector<NodeStmt *> stmts;
+    std::span<NodeStmt *> stmts;
 };
 
 struct NodeIfPred;
@@ -112,7 +82,7 @@ struct NodeIfPred;
 //
 struct NodeIfPredElif
 {
-    NodeExpr *expr{};
+    ExprRef expr{};
     NodeScope *scope{};
     std::optional<NodeIfPred *> pred;
 };
@@ -131,7 +101,7 @@ struct NodeIfPred
 // if statement has an expression, scope and an optional else or elif
 struct NodeStmtIf
 {
-    struct NodeExpr *expr{};
+    ExprRef expr{};
     struct NodeScope *scope{};
     std::optional<NodeIfPred *> pred;
 };
@@ -139,25 +109,25 @@ struct NodeStmtIf
 struct NodeStmtAssign
 {
     Token ident;
-    NodeExpr *expr{};
+    ExprRef expr{};
 };
 
 struct NodeStmtPrint
 {
-    struct NodeExpr *expr{};
+    ExprRef expr{};
 };
 
 struct NodeFunction
 {
     struct NodeTermIdent *function_name;
-    std::vector<NodeTermIdent *> parameters;
+    std::span<NodeTermIdent *> parameters;
     struct NodeScope *scope{};
 };
 
 struct NodeFunctionCall
 {
     struct NodeTermIdent *function_name;
-    std::vector<NodeExpr *> arguments;
+    std::span<ExprRef> arguments;
 };
 
 // statements available now
@@ -168,161 +138,152 @@ struct NodeStmt
 
 struct NodeProg
 {
-    std::vector<NodeStmt *> stmts;
+    std::span<NodeStmt *> stmts;
 };
 
 class Parser
 {
 
 public:
-    // vector of tokens and allocated memory as arguments to construct parse tree
-    explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens)), m_allocator(1024 * 1024 * 4)
+    // token stream as argument to construct parse tree, nodes go into an arena that grows with the program
+    // the stream must outlive the parse tree, its string table holds the text of the tokens in it
+    explicit Parser(const TokenStream &tokens)
+        : m_tokens(tokens), m_allocator(64 * 1024, true)
     {
     }
 
     // expected parsing errors
-    void error_expected(const std::string &msg) const
+    [[noreturn]] void error_expected(const std::string &msg) const
     {
-        std::cerr << "[Parse error] Expected " << msg << " on line " << peek(-1).value().line << std::endl;
-        exit(EXIT_FAILURE);
+        // the error is reported at the last consumed token, or the first one when nothing was consumed
+        const size_t at = m_index > 0 ? m_index - 1 : m_index;
+        const int line = at < m_tokens.size() ? m_tokens.line(m_tokens.at(at).pos) : m_tokens.line(0);
+        std::cerr << "[Parse error] Expected " << msg << " on line " << line << std::endl;
+        fail();
     }
 
-    std::optional<NodeTerm *> parse_term()
+    // literal or identifier
+    std::optional<ExprId> parse_term()
     {
         if (auto int_lit = try_consume(TokenType::int_lit))
         {
-            auto term_int_lit = m_allocator.emplace<NodeTermIntLit>(int_lit.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_int_lit);
-            return term;
+            return add_expr({ExprOp::int_lit, m_tokens.at(int_lit.value()).value, 0});
         }
         if (auto char_lit = try_consume(TokenType::char_lit))
         {
-            auto term_char_lit = m_allocator.emplace<NodeTermCharLit>(char_lit.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_char_lit);
-            return term;
+            return add_expr({ExprOp::char_lit, m_tokens.at(char_lit.value()).value, 0});
         }
         if (auto float_lit = try_consume(TokenType::float_lit))
         {
-            auto term_float_lit = m_allocator.emplace<NodeTermFloatLit>(float_lit.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_float_lit);
-            return term;
+            return add_expr({ExprOp::float_lit, m_tokens.at(float_lit.value()).value, 0});
         }
         if (auto ident = try_consume(TokenType::ident))
         {
-            auto term_ident = m_allocator.emplace<NodeTermIdent>(ident.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_ident);
-            return term;
-        }
-        if (try_consume(TokenType::open_paren))
-        {
-            auto expr = parse_expr();
-            if (!expr.has_value())
-            {
-                error_expected("expression");
-            }
-            try_consume_err(TokenType::close_paren);
-            auto term_paren = m_allocator.emplace<NodeTermParen>(expr.value());
-            auto term = m_allocator.emplace<NodeTerm>(term_paren);
-            return term;
+            return add_expr({ExprOp::ident, m_tokens.at(ident.value()).value, 0});
         }
         return {};
     }
 
-    std::optional<NodeExpr *> parse_expr(const int min_prec = 0)
+    // operator precedence parsing with explicit operand and operator stacks, so nesting depth is not limited by
+    // the call stack
+    // an open parenthesis on the operator stack marks where a parenthesised expression starts, a parenthesised
+    // expression is the expression itself, the tree already holds its grouping
+    std::optional<ExprId> parse_expr()
     {
-        std::optional<NodeTerm *> term_lhs = parse_term();
-        if (!term_lhs.has_value())
-        {
-            return {};
-        }
-        auto expr_lhs = m_allocator.emplace<NodeExpr>(term_lhs.value());
+        const size_t operand_base = m_operands.size();
+        const size_t operator_base = m_operators.size();
+        size_t open_parens = 0;
         while (true)
         {
-            std::optional<Token> cur_token = peek();
-            std::optional<int> prec;
-            if (cur_token.has_value())
+            // a term, after any number of open parentheses
+            while (try_consume(TokenType::open_paren))
             {
-                prec = bin_prec(cur_token.value().type);
-                if (!prec.has_value() || prec.value() < min_prec)
-                {
-                    break;
-                }
+                m_operators.push_back(TokenType::open_paren);
+                open_parens++;
             }
-            else
-            {
-                break;
-            }
-            const Token op = consume();
-            const int next_min_prec = prec.value() + 1;
-            auto expr_rhs = parse_expr(next_min_prec);
-            if (!expr_rhs.has_value())
+            const std::optional<ExprId> term = parse_term();
+            if (!term.has_value())
             {
+                if (m_operands.size() == operand_base && open_parens == 0)
+                {
+                    return {};
+                }
                 error_expected("expression");
             }
-            auto bin_expr = m_allocator.emplace<NodeBinExpr>();
-            auto expr_lhs_new = m_allocator.emplace<NodeExpr>();
-            if (op.type == TokenType::plus)
-            {
-                expr_lhs_new->var = expr_lhs->var;
-                auto bin_expr_add = m_allocator.emplace<NodeBinExprAdd>(expr_lhs_new, expr_rhs.value());
-                bin_expr->var = bin_expr_add;
-            }
-            else if (op.type == TokenType::star)
-            {
-                expr_lhs_new->var = expr_lhs->var;
-                auto bin_expr_mul = m_allocator.emplace<NodeBinExprMul>(expr_lhs_new, expr_rhs.value());
-                bin_expr->var = bin_expr_mul;
-            }
-            else if (op.type == TokenType::minus)
-            {
-                expr_lhs_new->var = expr_lhs->var;
-                auto bin_expr_sub = m_allocator.emplace<NodeBinExprSub>(expr_lhs_new, expr_rhs.value());
-                bin_expr->var = bin_expr_sub;
-            }
-            else if (op.type == TokenType::fslash)
+            m_operands.push_back(term.value());
+            // closing parentheses, then either a binary operator or the end of the expression
+            while (open_parens > 0 && try_consume(TokenType::close_paren))
             {
-                expr_lhs_new->var = expr_lhs->var;
-                auto bin_expr_div = m_allocator.emplace<NodeBinExprDiv>(expr_lhs_new, expr_rhs.value());
-                bin_expr->var = bin_expr_div;
+                while (m_operators.back() != TokenType::open_paren)
+                {
+                    reduce();
+                }
+                m_operators.pop_back();
+                open_parens--;
             }
-            else if (op.type == TokenType::percent)
+            const std::optional<int> prec = at_end() ? std::nullopt : bin_prec(m_tokens.type(m_index));
+            if (!prec.has_value())
             {
-                expr_lhs_new->var = expr_lhs->var;
-                auto bin_expr_Mod = m_allocator.emplace<NodeBinExprMod>(expr_lhs_new, expr_rhs.value());
-                bin_expr->var = bin_expr_Mod;
+                if (open_parens > 0)
+                {
+                    error_expected(to_string(TokenType::close_paren));
+                }
+                break;
             }
-            else
+            // operators are left associative, so pending ones of the same precedence are applied first
+            while (m_operators.size() > operator_base && m_operators.back() != TokenType::open_paren &&
+                   bin_prec(m_operators.back()).value() >= prec.value())
             {
-                assert(false);
+                reduce();
             }
-            expr_lhs->var = bin_expr;
+            m_operators.push_back(m_tokens.type(consume()));
+        }
+        while (m_operators.size() > operator_base)
+        {
+            reduce();
         }
-        return expr_lhs;
+        const ExprId expr = m_operands.back();
+        m_operands.pop_back();
+        return expr;
+    }
+
+    // expression parsed from the next tokens, as stored in statements
+    std::optional<ExprRef> parse_expr_ref()
+    {
+        if (auto expr = parse_expr())
+        {
+            return ExprRef{m_exprs.data(), expr.value()};
+        }
+        return {};
     }
 
     std::optional<NodeScope *> parse_scope()
     {
         if (try_consume(TokenType::open_curly))
         {
-            auto scope = m_allocator.alloc<NodeScope>();
+            auto scope = m_allocator.emplace<NodeScope>();
+            const size_t base = m_stmts.size();
             while (auto stmt = parse_stmt())
             {
-                scope->stmts.push_back(stmt.value());
+                m_stmts.push_back(stmt.value());
             }
+            scope->stmts = take(m_stmts, base);
             try_consume_err(TokenType::close_curly);
             return scope;
         }
         return {};
     }
 
+    // elif and else following an if, an elif chain is built in a loop, each elif linking to the rest of it
     std::optional<NodeIfPred *> parse_if_pred()
     {
-        if (try_consume(TokenType::elif))
+        std::optional<NodeIfPred *> first;
+        std::optional<NodeIfPred *> *link = &first;
+        while (try_consume(TokenType::elif))
         {
             try_consume_err(TokenType::open_paren);
-            auto if_pred_elif = m_allocator.alloc<NodeIfPredElif>();
-            if (auto expr = parse_expr())
+            auto if_pred_elif = m_allocator.emplace<NodeIfPredElif>();
+            if (auto expr = parse_expr_ref())
             {
                 if_pred_elif->expr = expr.value();
             }
@@ -339,13 +300,12 @@ public:
             {
                 error_expected("scope");
             }
-            if_pred_elif->pred = parse_if_pred();
-            auto if_pred = m_allocator.emplace<NodeIfPred>(if_pred_elif);
-            return if_pred;
+            *link = m_allocator.emplace<NodeIfPred>(if_pred_elif);
+            link = &if_pred_elif->pred;
         }
         if (try_consume(TokenType::_else))
         {
-            auto if_pred_else = m_allocator.alloc<NodeIfPredElse>();
+            auto if_pred_else = m_allocator.emplace<NodeIfPredElse>();
             if (auto scope = parse_scope())
             {
                 if_pred_else->scope = scope.value();
@@ -354,10 +314,9 @@ public:
             {
                 error_expected("scope");
             }
-            auto if_pred = m_allocator.emplace<NodeIfPred>(if_pred_else);
-            return if_pred;
+            *link = m_allocator.emplace<NodeIfPred>(if_pred_else);
         }
-        return {};
+        return first;
     }
 
     std::optional<NodeStmt *> parse_stmt()
@@ -365,8 +324,8 @@ public:
         if (try_consume(TokenType::exit))
         {
             try_consume_err(TokenType::open_paren);
-            auto stmt_exit = m_allocator.alloc<NodeStmtExit>();
-            if (auto expr_node = parse_expr())
+            auto stmt_exit = m_allocator.emplace<NodeStmtExit>();
+            if (auto expr_node = parse_expr_ref())
             {
                 stmt_exit->expr = expr_node.value();
             }
@@ -381,11 +340,11 @@ public:
         }
         if (try_consume(TokenType::let))
         {
-            auto ident = try_consume_err(TokenType::ident);
-            auto stmt_let = m_allocator.alloc<NodeStmtLet>();
+            const Token ident = m_tokens.at(try_consume_err(TokenType::ident));
+            auto stmt_let = m_allocator.emplace<NodeStmtLet>();
             try_consume_err(TokenType::eq);
             stmt_let->ident = ident;
-            if (auto expr = parse_expr())
+            if (auto expr = parse_expr_ref())
             {
                 stmt_let->expr = expr.value();
             }
@@ -405,8 +364,8 @@ public:
         if (try_consume(TokenType::_if))
         {
             try_consume_err(TokenType::open_paren);
-            auto stmt_if = m_allocator.alloc<NodeStmtIf>();
-            if (auto expr = parse_expr())
+            auto stmt_if = m_allocator.emplace<NodeStmtIf>();
+            if (auto expr = parse_expr_ref())
             {
                 stmt_if->expr = expr.value();
             }
@@ -429,16 +388,18 @@ public:
         }
         if (auto ident = try_consume(TokenType::ident))
         {
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            if (peek().has_value() && peek().value().type == TokenType::semi)
+            auto stmt = m_allocator.emplace<NodeStmt>();
+            if (peek_is(TokenType::semi))
             {
+                // a bare identifier does nothing, it becomes an empty scope
                 consume();
+                stmt->var = m_allocator.emplace<NodeScope>();
             }
-            else if (peek().has_value() && peek().value().type == TokenType::eq)
+            else if (peek_is(TokenType::eq))
             {
                 consume();
-                auto stmt_assign = m_allocator.emplace<NodeStmtAssign>(ident.value());
-                if (auto expr = parse_expr())
+                auto stmt_assign = m_allocator.emplace<NodeStmtAssign>(m_tokens.at(ident.value()));
+                if (auto expr = parse_expr_ref())
                 {
                     stmt_assign->expr = expr.value();
                 }
@@ -451,11 +412,11 @@ public:
             }
             else if (try_consume(TokenType::open_paren))
             {
-                std::vector<NodeExpr *> arguments;
-                while (auto argument = parse_expr())
+                const size_t base = m_arguments.size();
+                while (auto argument = parse_expr_ref())
                 {
-                    arguments.push_back(argument.value());
-                    if (peek().has_value() && peek().value().type == TokenType::close_paren)
+                    m_arguments.push_back(argument.value());
+                    if (peek_is(TokenType::close_paren))
                     {
                         break;
                     }
@@ -464,9 +425,10 @@ public:
                         try_consume_err(TokenType::comma);
                     }
                 }
+                const std::span<ExprRef> arguments = take(m_arguments, base);
                 try_consume_err(TokenType::close_paren);
                 try_consume_err(TokenType::semi);
-                auto function_name = m_allocator.emplace<NodeTermIdent>(ident.value());
+                auto function_name = m_allocator.emplace<NodeTermIdent>(m_tokens.at(ident.value()));
                 auto function_call = m_allocator.emplace<NodeFunctionCall>(function_name, arguments);
                 auto stmt = m_allocator.emplace<NodeStmt>(function_call);
                 return stmt;
@@ -480,9 +442,15 @@ public:
         if (try_consume(TokenType::print))
         {
             try_consume_err(TokenType::open_paren);
-            auto expr = parse_expr();
-            auto stmt_print = m_allocator.alloc<NodeStmtPrint>();
-            stmt_print->expr = expr.value();
+            auto stmt_print = m_allocator.emplace<NodeStmtPrint>();
+            if (auto expr = parse_expr_ref())
+            {
+                stmt_print->expr = expr.value();
+            }
+            else
+            {
+                error_expected("expression");
+            }
             try_consume_err(TokenType::close_paren);
             try_consume_err(TokenType::semi);
             auto stmt = m_allocator.emplace<NodeStmt>(stmt_print);
@@ -490,15 +458,14 @@ public:
         }
         if (try_consume(TokenType::function))
         {
-            auto ident = try_consume_err(TokenType::ident);
-            auto function_name = m_allocator.emplace<NodeTermIdent>(ident);
+            auto function_name = m_allocator.emplace<NodeTermIdent>(m_tokens.at(try_consume_err(TokenType::ident)));
             try_consume_err(TokenType::open_paren);
-            std::vector<NodeTermIdent *> parameters;
+            const size_t base = m_parameters.size();
             while (auto ident = try_consume(TokenType::ident))
             {
-                auto parameter = m_allocator.emplace<NodeTermIdent>(ident.value());
-                parameters.push_back(parameter);
-                if (peek().has_value() && peek().value().type == TokenType::close_paren)
+                auto parameter = m_allocator.emplace<NodeTermIdent>(m_tokens.at(ident.value()));
+                m_parameters.push_back(parameter);
+                if (peek_is(TokenType::close_paren))
                 {
                     break;
                 }
@@ -507,6 +474,7 @@ public:
                     try_consume_err(TokenType::comma);
                 }
             }
+            const std::span<NodeTermIdent *> parameters = take(m_parameters, base);
             try_consume_err(TokenType::close_paren);
 
             auto function = m_allocator.emplace<NodeFunction>(function_name, parameters);
@@ -524,65 +492,144 @@ public:
         return {};
     }
 
+    // index of the next token, statements parsed one at a time span the tokens between two calls
+    [[nodiscard]] size_t index() const
+    {
+        return m_index;
+    }
+
+    [[nodiscard]] bool at_end() const
+    {
+        return m_index >= m_tokens.size();
+    }
+
+    // memory held by the parse tree
+    [[nodiscard]] const ArenaAllocator::Stats &arena_stats() const
+    {
+        return m_allocator.stats();
+    }
+
+    // expression pool the statements point into
+    [[nodiscard]] std::span<const NodeExpr> exprs() const
+    {
+        return m_exprs;
+    }
+
     std::optional<NodeProg> parse_prog()
     {
         NodeProg prog;
-        while (peek().has_value())
+        const size_t base = m_stmts.size();
+        while (!at_end())
         {
             if (auto stmt = parse_stmt())
             {
-                prog.stmts.push_back(stmt.value());
+                m_stmts.push_back(stmt.value());
             }
             else
             {
                 error_expected("statement");
             }
         }
+        prog.stmts = take(m_stmts, base);
         return prog;
     }
 
 private:
-    // peeking next token
-    [[nodiscard]] std::optional<Token> peek(int offset = 0) const
+    // whether the token offset ahead exists and has the given type, only the type is read
+    [[nodiscard]] bool peek_is(const TokenType type, const int offset = 0) const
+    {
+        const size_t index = m_index + offset;
+        return index < m_tokens.size() && m_tokens.type(index) == type;
+    }
+
+    // consuming token, returns its index
+    size_t consume()
+    {
+        return m_index++;
+    }
+
+    // consuming an expected token otherwise error
+    size_t try_consume_err(const TokenType type)
     {
-        if (m_index + offset >= m_tokens.size())
+        if (!peek_is(type))
         {
-            return {};
+            error_expected(to_string(type));
         }
-        else
+        return consume();
+    }
+
+    // try to consume a particular token, returns its index
+    std::optional<size_t> try_consume(const TokenType type)
+    {
+        if (peek_is(type))
         {
-            return m_tokens.at(m_index + offset);
+            return consume();
         }
+        return {};
     }
 
-    // consuming token
-    Token consume()
+    // applies the operator on top of the operator stack to the two operands on top of the operand stack
+    void reduce()
     {
-        return m_tokens.at(m_index++);
+        const ExprId rhs = m_operands.back();
+        m_operands.pop_back();
+        const ExprId lhs = m_operands.back();
+        m_operands.back() = add_expr({bin_op(m_operators.back()), lhs, rhs});
+        m_operators.pop_back();
     }
 
-    // consuming an expected token otherwise error
-    Token try_consume_err(const TokenType type)
+    // appends a node to the expression pool
+    ExprId add_expr(const NodeExpr expr)
     {
-        if (peek().has_value() && peek().value().type == type)
+        // every node consumes a token of its own, so a pool sized for all tokens never moves while statements
+        // point into it
+        if (m_exprs.capacity() == 0)
         {
-            return consume();
+            m_exprs.reserve(m_tokens.size());
         }
-        error_expected(to_string(type));
-        return {};
+        assert(m_exprs.size() < m_exprs.capacity());
+        m_exprs.push_back(expr);
+        return static_cast<ExprId>(m_exprs.size() - 1);
     }
 
-    // try to consume a particular token
-    std::optional<Token> try_consume(const TokenType type)
+    static ExprOp bin_op(const TokenType type)
     {
-        if (peek().has_value() && peek().value().type == type)
+        switch (type)
         {
-            return consume();
+        case TokenType::plus:
+            return ExprOp::add;
+        case TokenType::minus:
+            return ExprOp::sub;
+        case TokenType::star:
+            return ExprOp::mul;
+        case TokenType::fslash:
+            return ExprOp::div;
+        case TokenType::percent:
+            return ExprOp::mod;
+        default:
+            assert(false);
+            return ExprOp::add;
         }
-        return {};
     }
 
-    const std::vector<Token> m_tokens;
+    // moves the items pushed since base off a scratch stack into the arena
+    template <typename T>
+    std::span<T> take(std::vector<T> &stack, const size_t base)
+    {
+        const std::span<T> items = m_allocator.copy(std::span<const T>(stack).subspan(base));
+        stack.resize(base);
+        return items;
+    }
+
+    const TokenStream &m_tokens;
     size_t m_index = 0;
     ArenaAllocator m_allocator;
+    std::vector<NodeExpr> m_exprs; // expression pool
+    // operands and operators of the expression being parsed
+    std::vector<ExprId> m_operands;
+    std::vector<TokenType> m_operators;
+    // items of the sequences being parsed, nested sequences stack on top of the ones enclosing them
+    std::vector<NodeStmt *> m_stmts;
+    std::vector<ExprRef> m_arguments;
+    std::vector<NodeTermIdent *> m_parameters;
 };
\ No newline at end of file
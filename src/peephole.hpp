@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "./machine.hpp"
+
+// rewrites short sequences of instructions into cheaper ones after registers are allocated
+// instructions are moved to the output one at a time, and after each one the rules are tried on the end of the output
+// until none applies, so a rewrite can enable another one on the instructions before it
+// rules may look ahead into the instructions not yet moved to find out whether a register is still needed
+// no register may be live at the end of the code given to run(), the generator hands over one top-level statement
+// at a time and nothing stays in a register between statements
+class Peephole
+{
+
+public:
+    // a rule rewrites the end of out in place and returns whether it did, rest is the code that follows out
+    using RuleFn = bool (*)(std::vector<Inst> &out, std::span<const Inst> rest);
+
+    struct Rule
+    {
+        std::string_view name;
+        RuleFn apply;
+        size_t hits = 0;
+    };
+
+    // there is no rule for push/pop pairs, since register allocation nothing is popped and the only push, of a new
+    // top-level variable, comes after the add rsp that releases the spill slots of its statement
+    Peephole()
+        : m_rules{
+              {"dead-mov", dead_mov},
+              {"forward-operand", forward_operand},
+              {"redundant-test", redundant_test},
+              {"jump-to-next", jump_to_next},
+          }
+    {
+    }
+
+    // rules added later are tried after the built-in ones
+    void add_rule(const std::string_view name, const RuleFn apply)
+    {
+        m_rules.push_back({name, apply});
+    }
+
+    // appends the rewritten code to out
+    void run(const std::span<const Inst> code, std::vector<Inst> &out)
+    {
+        const size_t first = out.size();
+        for (size_t i = 0; i < code.size(); i++)
+        {
+            out.push_back(code[i]);
+            const std::span<const Inst> rest = code.subspan(i + 1);
+            bool changed = true;
+            while (changed && out.size() > first)
+            {
+                changed = false;
+                for (Rule &rule : m_rules)
+                {
+                    if (rule.apply(out, rest))
+                    {
+                        rule.hits++;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] const std::vector<Rule> &rules() const
+    {
+        return m_rules;
+    }
+
+    // whether inst reads register r
+    static bool reads(const Inst &inst, const Reg r)
+    {
+        const auto uses = [&](const Operand &o)
+        {
+            return o.is(r) || (o.kind == Operand::Kind::mem && r == Reg::rsp);
+        };
+        switch (inst.op)
+        {
+        case Op::mov:
+        case Op::imul3:
+        case Op::lea:
+        case Op::pop:
+            // the destination is only written, unless it is memory addressed through r
+            return uses(inst.src) || (inst.dst.kind == Operand::Kind::mem && r == Reg::rsp) ||
+                   (inst.op == Op::pop && r == Reg::rsp);
+        case Op::xor_:
+            // xor of a register with itself is how a register is zeroed, it does not depend on the value
+            return inst.dst != inst.src && (uses(inst.dst) || uses(inst.src));
+        case Op::mul:
+            return r == Reg::rax || uses(inst.dst);
+        case Op::div:
+            return r == Reg::rax || r == Reg::rdx || uses(inst.dst);
+        case Op::push:
+            return r == Reg::rsp || uses(inst.dst);
+        case Op::syscall:
+            // number and arguments of a system call
+            return r == Reg::rax || r == Reg::rdi || r == Reg::rsi || r == Reg::rdx || r == Reg::r10 ||
+                   r == Reg::r8 || r == Reg::r9;
+        default:
+            return uses(inst.dst) || uses(inst.src);
+        }
+    }
+
+    // whether inst writes register r
+    static bool writes(const Inst &inst, const Reg r)
+    {
+        switch (inst.op)
+        {
+        case Op::mul:
+        case Op::div:
+            return r == Reg::rax || r == Reg::rdx;
+        case Op::push:
+        case Op::pop:
+            return r == Reg::rsp || inst.dst.is(r);
+        case Op::syscall:
+            return r == Reg::rax || r == Reg::rcx || r == Reg::r11;
+        case Op::test:
+        case Op::jz:
+        case Op::jmp:
+        case Op::label:
+            return false;
+        default:
+            return inst.dst.is(r);
+        }
+    }
+
+    // whether the value of r is not read again before it is overwritten, on every path through rest
+    // jumps only go forward, so the paths are followed to their labels further on in rest
+    // a search that takes too long gives up with the register live
+    static bool dead_after(const Reg r, const std::span<const Inst> rest)
+    {
+        if (r == Reg::rsp)
+        {
+            return false;
+        }
+        size_t budget = 256;
+        // starts of the paths left to follow
+        size_t paths[16];
+        size_t path_count = 0;
+        paths[path_count++] = 0;
+        while (path_count > 0)
+        {
+            for (size_t at = paths[--path_count];; at++)
+            {
+                if (at == rest.size())
+                {
+                    break;
+                }
+                const Inst &inst = rest[at];
+                if (budget-- == 0 || reads(inst, r))
+                {
+                    return false;
+                }
+                if (writes(inst, r))
+                {
+                    break;
+                }
+                if (inst.op == Op::jz || inst.op == Op::jmp)
+                {
+                    // the label is looked for no further than the budget reaches
+                    const auto end = rest.begin() + static_cast<ptrdiff_t>(std::min(rest.size(), at + budget));
+                    const auto label = std::find(rest.begin() + static_cast<ptrdiff_t>(at), end, Inst{Op::label, inst.dst});
+                    if (label == end || (inst.op == Op::jz && path_count == std::size(paths)))
+                    {
+                        return false;
+                    }
+                    if (inst.op == Op::jmp)
+                    {
+                        at = static_cast<size_t>(label - rest.begin());
+                        continue;
+                    }
+                    paths[path_count++] = static_cast<size_t>(label - rest.begin());
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    static bool is_reg(const Operand &o)
+    {
+        return o.kind == Operand::Kind::reg;
+    }
+
+    static bool is_mem(const Operand &o)
+    {
+        return o.kind == Operand::Kind::mem;
+    }
+
+    // immediates of instructions other than mov to a register are sign extended from 32 bits
+    static bool is_imm32(const Operand &o)
+    {
+        return o.kind == Operand::Kind::imm && o.value == static_cast<int32_t>(o.value);
+    }
+
+    // a move into a register nothing reads
+    static bool dead_mov(std::vector<Inst> &out, const std::span<const Inst> rest)
+    {
+        const Inst &mov = out.back();
+        if (mov.op != Op::mov || !is_reg(mov.dst) || !dead_after(mov.dst.reg(), rest))
+        {
+            return false;
+        }
+        out.pop_back();
+        return true;
+    }
+
+    // a value moved into a register only to be used once by the next instruction is used from where it came from
+    static bool forward_operand(std::vector<Inst> &out, const std::span<const Inst> rest)
+    {
+        if (out.size() < 2)
+        {
+            return false;
+        }
+        const Inst &mov = out[out.size() - 2];
+        Inst next = out.back();
+        if (mov.op != Op::mov || !is_reg(mov.dst))
+        {
+            return false;
+        }
+        const Reg r = mov.dst.reg();
+        const Operand &from = mov.src;
+        // where the value goes, the register must not be read in any other way
+        Operand *use = nullptr;
+        switch (next.op)
+        {
+        case Op::mov:
+        case Op::add:
+        case Op::sub:
+        case Op::imul:
+        case Op::imul3:
+        case Op::and_:
+        case Op::xor_:
+            use = next.src.is(r) && !next.dst.is(r) ? &next.src : nullptr;
+            break;
+        case Op::push:
+        case Op::mul:
+        case Op::div:
+            use = next.dst.is(r) ? &next.dst : nullptr;
+            break;
+        default:
+            break;
+        }
+        if (use == nullptr || !dead_after(r, rest))
+        {
+            return false;
+        }
+        if (!has_form(next, from))
+        {
+            return false;
+        }
+        *use = from;
+        out.resize(out.size() - 2);
+        if (next.op != Op::mov || next.dst != next.src)
+        {
+            out.push_back(next);
+        }
+        return true;
+    }
+
+    // whether x86 has a form of inst with from as the operand that reads a value
+    static bool has_form(const Inst &inst, const Operand &from)
+    {
+        if (is_reg(from))
+        {
+            return true;
+        }
+        switch (inst.op)
+        {
+        case Op::mov:
+            // a register takes any immediate, memory only a register or a small immediate
+            return is_reg(inst.dst) || is_imm32(from);
+        case Op::add:
+        case Op::sub:
+        case Op::and_:
+        case Op::xor_:
+            return is_imm32(from) || (is_mem(from) && is_reg(inst.dst));
+        case Op::imul:
+        case Op::push:
+            return is_imm32(from) || is_mem(from);
+        case Op::imul3:
+        case Op::mul:
+        case Op::div:
+            return is_mem(from);
+        default:
+            return false;
+        }
+    }
+
+    // add, sub, and, xor and shifts by an immediate other than 0 set the zero flag from their result already
+    static bool redundant_test(std::vector<Inst> &out, std::span<const Inst>)
+    {
+        if (out.size() < 2)
+        {
+            return false;
+        }
+        const Inst &alu = out[out.size() - 2];
+        const Inst &test = out.back();
+        // a shift by 0 leaves the flags as they were
+        const bool shift = alu.op == Op::shl || alu.op == Op::shr;
+        if (test.op != Op::test || !is_reg(test.dst) || test.dst != test.src ||
+            (alu.op != Op::add && alu.op != Op::sub && alu.op != Op::and_ && alu.op != Op::xor_ && !shift) ||
+            (shift && (alu.src.kind != Operand::Kind::imm || alu.src.value == 0)) || alu.dst != test.dst)
+        {
+            return false;
+        }
+        out.pop_back();
+        return true;
+    }
+
+    // a jump to the label right after it
+    static bool jump_to_next(std::vector<Inst> &out, std::span<const Inst>)
+    {
+        if (out.size() < 2)
+        {
+            return false;
+        }
+        const Inst &jmp = out[out.size() - 2];
+        const Inst &label = out.back();
+        if (jmp.op != Op::jmp || label.op != Op::label || jmp.dst != label.dst)
+        {
+            return false;
+        }
+        out.erase(out.end() - 2);
+        return true;
+    }
+
+    std::vector<Rule> m_rules;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <span>
+#include <vector>
+
+#include "./machine.hpp"
+
+// linear scan register allocation over the code of one top-level statement
+// the language has no loops, every jump goes forward, so a virtual register is live from its first to its last
+// appearance in program order and its interval is just those two positions
+// virtual registers are numbered in the order they first appear, so the intervals come sorted by start
+// when every register is taken, the interval that ends last goes to a stack slot for its whole life
+class RegisterAllocator
+{
+
+public:
+    // totals over everything allocated so far, reported by --stats
+    struct Stats
+    {
+        size_t vregs = 0;   // virtual registers allocated
+        size_t spilled = 0; // virtual registers that live on the stack
+        size_t insts = 0;   // instructions written
+    };
+
+    // appends insts to out with registers and rsp relative memory in place of virtual registers and variable slots
+    // depth is the stack depth in 8-byte words where insts start, spill slots are reserved below it and released at
+    // the end, so the depth after the code is depth again plus whatever insts push
+    void allocate(const std::span<const Inst> insts, const uint32_t vreg_count, size_t depth, std::vector<Inst> &out)
+    {
+        compute_intervals(insts, vreg_count);
+        const size_t slots = assign(vreg_count);
+        const size_t first = out.size();
+        const size_t base = depth;
+        if (slots != 0)
+        {
+            out.push_back({Op::sub, Operand::reg_of(Reg::rsp), Operand::imm_of(static_cast<int64_t>(slots * 8))});
+            depth += slots;
+        }
+        for (const Inst &inst : insts)
+        {
+            Inst real = inst;
+            real.dst = resolve(locate(inst.dst, base), depth);
+            real.src = resolve(locate(inst.src, base), depth);
+            legalize(real, out);
+            if (inst.op == Op::push)
+            {
+                depth++;
+            }
+            else if (inst.op == Op::pop)
+            {
+                depth--;
+            }
+        }
+        if (slots != 0)
+        {
+            out.push_back({Op::add, Operand::reg_of(Reg::rsp), Operand::imm_of(static_cast<int64_t>(slots * 8))});
+        }
+        m_stats.vregs += vreg_count;
+        m_stats.insts += out.size() - first;
+    }
+
+    [[nodiscard]] const Stats &stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    // registers handed out, rax and rdx are left for division and for rewriting instructions with spilled operands
+    static constexpr std::array<Reg, 13> allocatable = {
+        Reg::rbx, Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10,
+        Reg::r11, Reg::r12, Reg::r13, Reg::r14, Reg::r15, Reg::rbp};
+
+    void compute_intervals(const std::span<const Inst> insts, const uint32_t vreg_count)
+    {
+        m_start.assign(vreg_count, UINT32_MAX);
+        m_end.assign(vreg_count, 0);
+        for (uint32_t i = 0; i < insts.size(); i++)
+        {
+            for (const Operand *o : {&insts[i].dst, &insts[i].src})
+            {
+                if (o->kind == Operand::Kind::vreg)
+                {
+                    m_start[o->value] = std::min(m_start[o->value], i);
+                    m_end[o->value] = i;
+                }
+            }
+        }
+    }
+
+    // gives every virtual register a register or a spill slot, returns the number of spill slots
+    size_t assign(const uint32_t vreg_count)
+    {
+        m_location.assign(vreg_count, {});
+        m_active.clear();
+        m_free.assign(allocatable.rbegin(), allocatable.rend());
+        m_free_slots.clear();
+        m_spill_ends = {};
+        size_t slots = 0;
+        // an interval spilled after it started needs a slot that was already free when it started
+        const auto spill = [&](const uint32_t vreg)
+        {
+            size_t slot = slots;
+            const auto reusable = std::find_if(m_free_slots.rbegin(), m_free_slots.rend(), [&](const std::pair<size_t, uint32_t> &free)
+                                               { return free.second <= m_start[vreg]; });
+            if (reusable != m_free_slots.rend())
+            {
+                slot = reusable->first;
+                m_free_slots.erase(std::next(reusable).base());
+            }
+            else
+            {
+                slots++;
+            }
+            m_location[vreg] = {Operand::Kind::slot, static_cast<int64_t>(slot)};
+            m_spill_ends.push({m_end[vreg], slot});
+            m_stats.spilled++;
+        };
+        for (uint32_t vreg = 0; vreg < vreg_count; vreg++)
+        {
+            if (m_start[vreg] == UINT32_MAX)
+            {
+                continue;
+            }
+            // an interval ending where this one starts is read by the instruction that defines this one, they can
+            // share a register
+            const uint32_t start = m_start[vreg];
+            std::erase_if(m_active, [&](const uint32_t active)
+                          {
+                              if (m_end[active] > start)
+                              {
+                                  return false;
+                              }
+                              m_free.push_back(m_location[active].reg());
+                              return true; });
+            while (!m_spill_ends.empty() && m_spill_ends.top().first <= start)
+            {
+                m_free_slots.emplace_back(m_spill_ends.top().second, m_spill_ends.top().first);
+                m_spill_ends.pop();
+            }
+            if (!m_free.empty())
+            {
+                m_location[vreg] = Operand::reg_of(m_free.back());
+                m_free.pop_back();
+                m_active.push_back(vreg);
+                continue;
+            }
+            const auto furthest = std::max_element(m_active.begin(), m_active.end(), [&](const uint32_t a, const uint32_t b)
+                                                   { return m_end[a] < m_end[b]; });
+            if (m_end[*furthest] > m_end[vreg])
+            {
+                m_location[vreg] = m_location[*furthest];
+                spill(*furthest);
+                *furthest = vreg;
+            }
+            else
+            {
+                spill(vreg);
+            }
+        }
+        return slots;
+    }
+
+    // where an operand lives, spill slot s is the word s + 1 below the stack depth the code starts at
+    [[nodiscard]] Operand locate(const Operand &o, const size_t base) const
+    {
+        if (o.kind != Operand::Kind::vreg)
+        {
+            return o;
+        }
+        const Operand &location = m_location[o.value];
+        if (location.kind == Operand::Kind::slot)
+        {
+            return {Operand::Kind::slot, static_cast<int64_t>(base + 1) + location.value};
+        }
+        return location;
+    }
+
+    // rsp relative address of a stack slot at the given depth
+    static Operand resolve(const Operand &o, const size_t depth)
+    {
+        if (o.kind != Operand::Kind::slot)
+        {
+            return o;
+        }
+        return {Operand::Kind::mem, (static_cast<int64_t>(depth) - o.value) * 8};
+    }
+
+    // appends inst, going through rax where x86 has no form for its operands
+    static void legalize(const Inst &inst, std::vector<Inst> &out)
+    {
+        const Operand rax = Operand::reg_of(Reg::rax);
+        const bool dst_mem = inst.dst.kind == Operand::Kind::mem;
+        const bool src_mem = inst.src.kind == Operand::Kind::mem;
+        switch (inst.op)
+        {
+        case Op::mov:
+            if (inst.dst == inst.src)
+            {
+                return;
+            }
+            // memory takes at most a sign extended 32-bit immediate
+            if (dst_mem && (src_mem || inst.src.kind == Operand::Kind::lit ||
+                            (inst.src.kind == Operand::Kind::imm && inst.src.value != static_cast<int32_t>(inst.src.value))))
+            {
+                out.push_back({Op::mov, rax, inst.src});
+                out.push_back({Op::mov, inst.dst, rax});
+                return;
+            }
+            break;
+        case Op::add:
+        case Op::sub:
+        case Op::and_:
+        case Op::xor_:
+            // an immediate is sign extended from 32 bits
+            if ((dst_mem && src_mem) ||
+                (inst.src.kind == Operand::Kind::imm && inst.src.value != static_cast<int32_t>(inst.src.value)))
+            {
+                out.push_back({Op::mov, rax, inst.src});
+                out.push_back({inst.op, inst.dst, rax});
+                return;
+            }
+            break;
+        case Op::imul3:
+            // the product goes to a register
+            if (dst_mem)
+            {
+                out.push_back({Op::imul3, rax, inst.src, inst.imm});
+                out.push_back({Op::mov, inst.dst, rax});
+                return;
+            }
+            break;
+        case Op::lea:
+            // addresses are made of registers and the result goes to one
+            if (dst_mem || src_mem)
+            {
+                const Operand src = src_mem ? rax : inst.src;
+                if (src_mem)
+                {
+                    out.push_back({Op::mov, rax, inst.src});
+                }
+                out.push_back({Op::lea, dst_mem ? rax : inst.dst, src, inst.imm});
+                if (dst_mem)
+                {
+                    out.push_back({Op::mov, inst.dst, rax});
+                }
+                return;
+            }
+            break;
+        case Op::imul:
+            // the product goes to a register
+            if (dst_mem)
+            {
+                out.push_back({Op::mov, rax, inst.dst});
+                out.push_back({Op::imul, rax, inst.src});
+                out.push_back({Op::mov, inst.dst, rax});
+                return;
+            }
+            break;
+        case Op::test:
+            if (dst_mem)
+            {
+                out.push_back({Op::mov, rax, inst.dst});
+                out.push_back({Op::test, rax, rax});
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+        out.push_back(inst);
+    }
+
+    std::vector<uint32_t> m_start;  // by virtual register, first instruction it appears in
+    std::vector<uint32_t> m_end;    // by virtual register, last instruction it appears in
+    std::vector<Operand> m_location; // by virtual register, its register or spill slot
+    std::vector<uint32_t> m_active; // virtual registers holding a register at the current position
+    std::vector<Reg> m_free;        // registers not held
+    std::vector<std::pair<size_t, uint32_t>> m_free_slots; // spill slots not in use, and since which position
+    // spill slots in use by the position their interval ends at, soonest first
+    std::priority_queue<std::pair<uint32_t, size_t>, std::vector<std::pair<uint32_t, size_t>>, std::greater<>> m_spill_ends;
+    Stats m_stats{};
+};
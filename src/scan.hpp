@@ -0,0 +1,318 @@
+#pragma once
+
+#include <cstddef>
+
+// defining BLUE_SCAN_SCALAR forces the portable loops
+#if defined(__x86_64__) && !defined(BLUE_SCAN_SCALAR)
+#include <immintrin.h>
+#define BLUE_SCAN_X86 1
+#endif
+
+// bulk character scanning for the tokenizer
+// each routine takes the current position and the end of the source and returns the position where the run stops
+// x86-64 scans 16 bytes at a time with SSE2, or 32 at a time with AVX2 when the cpu supports it
+// other targets and the last few bytes of the source use the scalar loops
+namespace scan
+{
+    inline bool is_space(const char c)
+    {
+        return c == ' ' || static_cast<unsigned char>(c - '\t') <= '\r' - '\t';
+    }
+
+    inline bool is_digit(const char c)
+    {
+        return static_cast<unsigned char>(c - '0') <= 9;
+    }
+
+    inline bool is_alpha(const char c)
+    {
+        // folding to lower case maps both letter ranges onto 'a'..'z'
+        return static_cast<unsigned char>((c | 0x20) - 'a') <= 'z' - 'a';
+    }
+
+    inline bool is_alnum(const char c)
+    {
+        return is_digit(c) || is_alpha(c);
+    }
+
+    namespace scalar
+    {
+        inline const char *skip_space(const char *p, const char *end)
+        {
+            while (p < end && is_space(*p))
+            {
+                p++;
+            }
+            return p;
+        }
+
+        inline const char *skip_alnum(const char *p, const char *end)
+        {
+            while (p < end && is_alnum(*p))
+            {
+                p++;
+            }
+            return p;
+        }
+
+        inline const char *skip_digits(const char *p, const char *end)
+        {
+            while (p < end && is_digit(*p))
+            {
+                p++;
+            }
+            return p;
+        }
+
+        inline const char *find_line_end(const char *p, const char *end)
+        {
+            while (p < end && *p != '\n')
+            {
+                p++;
+            }
+            return p;
+        }
+
+        inline const char *find_comment_end(const char *p, const char *end)
+        {
+            while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/'))
+            {
+                p++;
+            }
+            return p;
+        }
+    }
+
+#ifdef BLUE_SCAN_X86
+    // per-lane class masks, a set bit means the byte belongs to the class
+    namespace sse
+    {
+        inline unsigned space_mask(const __m128i v)
+        {
+            // '\t'..'\r' are contiguous, so an unsigned range check covers them in one compare
+            const __m128i ctrl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+            const __m128i in_ctrl = _mm_cmpeq_epi8(_mm_min_epu8(ctrl, _mm_set1_epi8('\r' - '\t')), ctrl);
+            const __m128i blank = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+            return static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(in_ctrl, blank)));
+        }
+
+        inline unsigned digit_mask(const __m128i v)
+        {
+            const __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+            return static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d)));
+        }
+
+        inline unsigned alnum_mask(const __m128i v)
+        {
+            // folding to lower case maps both letter ranges onto 'a'..'z'
+            const __m128i a = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+            const __m128i alpha = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8('z' - 'a')), a);
+            return digit_mask(v) | static_cast<unsigned>(_mm_movemask_epi8(alpha));
+        }
+
+        inline unsigned eq_mask(const __m128i v, const char c)
+        {
+            return static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))));
+        }
+
+        inline __m128i load(const char *p)
+        {
+            return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        }
+    }
+
+    namespace avx2
+    {
+        __attribute__((target("avx2"))) inline unsigned space_mask(const __m256i v)
+        {
+            const __m256i ctrl = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+            const __m256i in_ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(ctrl, _mm256_set1_epi8('\r' - '\t')), ctrl);
+            const __m256i blank = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+            return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(in_ctrl, blank)));
+        }
+
+        __attribute__((target("avx2"))) inline unsigned digit_mask(const __m256i v)
+        {
+            const __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+            return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d)));
+        }
+
+        __attribute__((target("avx2"))) inline unsigned alnum_mask(const __m256i v)
+        {
+            const __m256i a = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+            const __m256i alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8('z' - 'a')), a);
+            return digit_mask(v) | static_cast<unsigned>(_mm256_movemask_epi8(alpha));
+        }
+
+        __attribute__((target("avx2"))) inline unsigned eq_mask(const __m256i v, const char c)
+        {
+            return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))));
+        }
+
+        __attribute__((target("avx2"))) inline __m256i load(const char *p)
+        {
+            return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        }
+
+        __attribute__((target("avx2"))) inline const char *skip_space(const char *p, const char *end)
+        {
+            while (end - p >= 32)
+            {
+                const unsigned stop = ~space_mask(load(p));
+                if (stop != 0)
+                {
+                    return p + __builtin_ctz(stop);
+                }
+                p += 32;
+            }
+            return p;
+        }
+
+        __attribute__((target("avx2"))) inline const char *skip_alnum(const char *p, const char *end)
+        {
+            while (end - p >= 32)
+            {
+                const unsigned stop = ~alnum_mask(load(p));
+                if (stop != 0)
+                {
+                    return p + __builtin_ctz(stop);
+                }
+                p += 32;
+            }
+            return p;
+        }
+
+        __attribute__((target("avx2"))) inline const char *skip_digits(const char *p, const char *end)
+        {
+            while (end - p >= 32)
+            {
+                const unsigned stop = ~digit_mask(load(p));
+                if (stop != 0)
+                {
+                    return p + __builtin_ctz(stop);
+                }
+                p += 32;
+            }
+            return p;
+        }
+
+        __attribute__((target("avx2"))) inline const char *find_line_end(const char *p, const char *end)
+        {
+            while (end - p >= 32)
+            {
+                const unsigned nl = eq_mask(load(p), '\n');
+                if (nl != 0)
+                {
+                    return p + __builtin_ctz(nl);
+                }
+                p += 32;
+            }
+            return p;
+        }
+
+        __attribute__((target("avx2"))) inline const char *find_comment_end(const char *p, const char *end)
+        {
+            // the second load is one byte ahead so a "*/" straddling two blocks is still seen
+            while (end - p > 32)
+            {
+                const unsigned close = eq_mask(load(p), '*') & eq_mask(load(p + 1), '/');
+                if (close != 0)
+                {
+                    return p + __builtin_ctz(close);
+                }
+                p += 32;
+            }
+            return p;
+        }
+    }
+
+    inline bool has_avx2()
+    {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+
+    // checks the first block with SSE2 so short runs, the common case, never pay for the AVX2 call
+    // runs longer than one block continue 32 bytes at a time with AVX2 when the cpu has it
+    // lookahead is how many bytes past the block stop_mask reads
+    template <typename StopMask, typename Avx2Loop>
+    inline const char *run(const char *p, const char *end, const ptrdiff_t lookahead, StopMask stop_mask, Avx2Loop avx2_loop)
+    {
+        if (end - p < 16 + lookahead)
+        {
+            return p;
+        }
+        unsigned stop = stop_mask(p);
+        if (stop != 0)
+        {
+            return p + __builtin_ctz(stop);
+        }
+        p += 16;
+        if (has_avx2())
+        {
+            p = avx2_loop(p, end);
+        }
+        while (end - p >= 16 + lookahead)
+        {
+            stop = stop_mask(p);
+            if (stop != 0)
+            {
+                return p + __builtin_ctz(stop);
+            }
+            p += 16;
+        }
+        return p;
+    }
+#endif
+
+    // skips whitespace
+    inline const char *skip_space(const char *p, const char *end)
+    {
+#ifdef BLUE_SCAN_X86
+        p = run(p, end, 0, [](const char *q)
+                { return ~sse::space_mask(sse::load(q)) & 0xFFFFu; }, avx2::skip_space);
+#endif
+        return scalar::skip_space(p, end);
+    }
+
+    // skips letters and digits (rest of an identifier or keyword)
+    inline const char *skip_alnum(const char *p, const char *end)
+    {
+#ifdef BLUE_SCAN_X86
+        p = run(p, end, 0, [](const char *q)
+                { return ~sse::alnum_mask(sse::load(q)) & 0xFFFFu; }, avx2::skip_alnum);
+#endif
+        return scalar::skip_alnum(p, end);
+    }
+
+    // skips decimal digits
+    inline const char *skip_digits(const char *p, const char *end)
+    {
+#ifdef BLUE_SCAN_X86
+        p = run(p, end, 0, [](const char *q)
+                { return ~sse::digit_mask(sse::load(q)) & 0xFFFFu; }, avx2::skip_digits);
+#endif
+        return scalar::skip_digits(p, end);
+    }
+
+    // body of a // comment, stops at the newline (not consumed) or the end
+    inline const char *find_line_end(const char *p, const char *end)
+    {
+#ifdef BLUE_SCAN_X86
+        p = run(p, end, 0, [](const char *q)
+                { return sse::eq_mask(sse::load(q), '\n'); }, avx2::find_line_end);
+#endif
+        return scalar::find_line_end(p, end);
+    }
+
+    // body of a /* */ comment, stops at the closing "*/" (not consumed) or the end
+    inline const char *find_comment_end(const char *p, const char *end)
+    {
+#ifdef BLUE_SCAN_X86
+        // the second load is one byte ahead so a "*/" straddling two blocks is still seen
+        p = run(p, end, 1, [](const char *q)
+                { return sse::eq_mask(sse::load(q), '*') & sse::eq_mask(sse::load(q + 1), '/'); }, avx2::find_comment_end);
+#endif
+        return scalar::find_comment_end(p, end);
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// read-only contents of a .blu file
+// regular files are memory mapped so tokens can be views into the mapped bytes without copying
+// the object must outlive the tokenizer, parser and generator that reference it
+class SourceFile
+{
+
+public:
+    explicit SourceFile(const char *path)
+    {
+        const int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Unable to open file: " << path << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                // the tokenizer walks the file front to back
+                madvise(addr, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+                m_data = static_cast<const char *>(addr);
+                m_size = static_cast<size_t>(st.st_size);
+                m_mapped = true;
+            }
+        }
+        // pipes, empty files or failed mappings are read into an owned buffer
+        if (!m_mapped)
+        {
+            char chunk[1 << 16];
+            ssize_t n;
+            while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+            {
+                m_buffer.append(chunk, static_cast<size_t>(n));
+            }
+            m_data = m_buffer.data();
+            m_size = m_buffer.size();
+        }
+        close(fd);
+    }
+
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    [[nodiscard]] std::string_view view() const
+    {
+        return {m_data, m_size};
+    }
+
+    ~SourceFile()
+    {
+        if (m_mapped)
+        {
+            munmap(const_cast<char *>(m_data), m_size);
+        }
+    }
+
+private:
+    const char *m_data = nullptr; // start of file contents
+    size_t m_size = 0;            // size of file contents
+    bool m_mapped = false;        // whether m_data is an mmap of the file
+    std::string m_buffer;         // contents when the file could not be mapped
+};
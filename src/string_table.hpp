@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// interns the text of identifiers and literals, each distinct text gets a dense id starting at 0
+// texts are views, so whatever they point into must outlive the table
+// a table that copies texts keeps its own copy of each distinct text instead, for sources that change while it is in use
+class StringTable
+{
+
+public:
+    explicit StringTable(const bool copy_texts = false)
+        : m_copy_texts(copy_texts)
+    {
+    }
+
+    uint32_t intern(const std::string_view text)
+    {
+        // keeping the load factor at or below one half keeps probe sequences short
+        if ((m_texts.size() + 1) * 2 > m_slots.size())
+        {
+            grow();
+        }
+        const size_t mask = m_slots.size() - 1;
+        for (size_t slot = hash(text) & mask;; slot = (slot + 1) & mask)
+        {
+            const uint32_t entry = m_slots[slot];
+            if (entry == 0)
+            {
+                m_texts.push_back(m_copy_texts ? store(text) : text);
+                m_slots[slot] = static_cast<uint32_t>(m_texts.size());
+                return static_cast<uint32_t>(m_texts.size() - 1);
+            }
+            if (m_texts[entry - 1] == text)
+            {
+                return entry - 1;
+            }
+        }
+    }
+
+    [[nodiscard]] std::string_view text(const uint32_t id) const
+    {
+        return m_texts[id];
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_texts.size();
+    }
+
+private:
+    // FNV-1a, identifiers and literals are short
+    static size_t hash(const std::string_view text)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (const char c : text)
+        {
+            h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+
+    // copies text into the current storage block, starting a new block when it does not fit
+    std::string_view store(const std::string_view text)
+    {
+        if (m_blocks.empty() || m_block_used + text.size() > m_block_size)
+        {
+            m_block_size = std::max<size_t>(64 * 1024, text.size());
+            m_blocks.push_back(std::make_unique<char[]>(m_block_size));
+            m_block_used = 0;
+        }
+        char *copy = m_blocks.back().get() + m_block_used;
+        std::memcpy(copy, text.data(), text.size());
+        m_block_used += text.size();
+        return {copy, text.size()};
+    }
+
+    void grow()
+    {
+        m_slots.assign(m_slots.empty() ? 64 : m_slots.size() * 2, 0);
+        const size_t mask = m_slots.size() - 1;
+        for (size_t id = 0; id < m_texts.size(); id++)
+        {
+            size_t slot = hash(m_texts[id]) & mask;
+            while (m_slots[slot] != 0)
+            {
+                slot = (slot + 1) & mask;
+            }
+            m_slots[slot] = static_cast<uint32_t>(id + 1);
+        }
+    }
+
+    std::vector<std::string_view> m_texts; // text of each id
+    std::vector<uint32_t> m_slots;         // open addressed table of id + 1, 0 marks an empty slot
+    bool m_copy_texts;
+    std::vector<std::unique_ptr<char[]>> m_blocks; // copies of the texts when m_copy_texts is set
+    size_t m_block_used = 0;
+    size_t m_block_size = 0;
+};
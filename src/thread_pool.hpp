@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// runs fn(0) .. fn(count - 1) across worker threads, workers take the next index as they finish one
+// workers are started for each call and joined before it returns
+// the calling thread works too, so a pool of one thread runs everything inline
+class ThreadPool
+{
+
+public:
+    explicit ThreadPool(const unsigned threads)
+        : m_threads(std::max(threads, 1u))
+    {
+    }
+
+    // number of threads available on this machine
+    static unsigned hardware_threads()
+    {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    template <typename Fn>
+    void parallel_for(const size_t count, Fn &&fn) const
+    {
+        std::atomic<size_t> next{0};
+        const auto work = [&]
+        {
+            for (size_t i = next++; i < count; i = next++)
+            {
+                fn(i);
+            }
+        };
+        std::vector<std::thread> workers;
+        const size_t spawn = std::min<size_t>(m_threads, count) - (count > 0 ? 1 : 0);
+        workers.reserve(spawn);
+        for (size_t i = 0; i < spawn; i++)
+        {
+            workers.emplace_back(work);
+        }
+        work();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    [[nodiscard]] unsigned threads() const
+    {
+        return m_threads;
+    }
+
+private:
+    unsigned m_threads;
+};
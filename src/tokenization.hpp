@@ -1,7 +1,23 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "./diagnostics.hpp"
+#include "./scan.hpp"
+#include "./string_table.hpp"
+#include "./thread_pool.hpp"
+
 // Tokens available in language
-enum class TokenType
+enum class TokenType : uint8_t
 {
     exit,
     int_lit,
@@ -101,243 +117,540 @@ inline std::optional<int> bin_prec(const TokenType type)
     }
 }
 
+// keywords of the language, an identifier is checked against these after it is scanned
+struct Keyword
+{
+    std::string_view text;
+    TokenType type;
+};
+
+inline constexpr std::array keywords{
+    Keyword{"exit", TokenType::exit},
+    Keyword{"let", TokenType::let},
+    Keyword{"if", TokenType::_if},
+    Keyword{"else", TokenType::_else},
+    Keyword{"elif", TokenType::elif},
+    Keyword{"print", TokenType::print},
+    Keyword{"function", TokenType::function},
+};
+
+// perfect hash of the keywords, built at compile time
+// the hash only reads the length and the first and last characters, so its cost does not grow with the keyword set
+namespace keyword_hash
+{
+    inline constexpr uint32_t bits = 4; // slots = 16, grow if the keyword set stops fitting
+
+    constexpr uint32_t hash(const std::string_view text, const uint32_t seed)
+    {
+        const uint32_t key = static_cast<unsigned char>(text.front()) |
+                             static_cast<unsigned char>(text.back()) << 8 |
+                             static_cast<uint32_t>(text.size()) << 16;
+        return (key * seed) >> (32 - bits);
+    }
+
+    // searches for a multiplier that places every keyword in its own slot
+    constexpr uint32_t find_seed()
+    {
+        for (uint32_t seed = 0x9E3779B1u; seed != 0; seed += 2)
+        {
+            std::array<bool, 1u << bits> used{};
+            bool collision = false;
+            for (const Keyword &kw : keywords)
+            {
+                const uint32_t slot = hash(kw.text, seed);
+                collision = collision || used[slot];
+                used[slot] = true;
+            }
+            if (!collision)
+            {
+                return seed;
+            }
+        }
+        throw "no perfect hash seed for the keyword set";
+    }
+
+    inline constexpr uint32_t seed = find_seed();
+
+    // empty slots hold an empty text, which no identifier matches
+    inline constexpr std::array<Keyword, 1u << bits> table = []
+    {
+        std::array<Keyword, 1u << bits> slots{};
+        for (const Keyword &kw : keywords)
+        {
+            slots[hash(kw.text, seed)] = kw;
+        }
+        return slots;
+    }();
+}
+
+// keyword type of an identifier, or ident when it is not a keyword
+inline TokenType keyword_or_ident(const std::string_view text)
+{
+    const Keyword &slot = keyword_hash::table[keyword_hash::hash(text, keyword_hash::seed)];
+    return slot.text == text ? slot.type : TokenType::ident;
+}
+
+// how the tokenizer handles a token starting with a given character
+enum class CharClass : uint8_t
+{
+    invalid,
+    space,
+    alpha,
+    number, // digits and '.' start int and float literals
+    slash,  // division or the start of a comment
+    quote,  // char literal
+    single, // one character token, type in CharInfo
+};
+
+struct CharInfo
+{
+    CharClass cls = CharClass::invalid;
+    TokenType type{};
+};
+
+// class and single character token type of every byte
+inline constexpr std::array<CharInfo, 256> char_table = []
+{
+    std::array<CharInfo, 256> table{};
+    for (const char c : std::string_view{" \t\n\v\f\r"})
+    {
+        table[static_cast<unsigned char>(c)].cls = CharClass::space;
+    }
+    for (int c = 'a'; c <= 'z'; c++)
+    {
+        table[c].cls = CharClass::alpha;
+        table[c - 'a' + 'A'].cls = CharClass::alpha;
+    }
+    for (int c = '0'; c <= '9'; c++)
+    {
+        table[c].cls = CharClass::number;
+    }
+    table['.'].cls = CharClass::number;
+    table['/'].cls = CharClass::slash;
+    table['\''].cls = CharClass::quote;
+    constexpr std::pair<char, TokenType> singles[] = {
+        {'=', TokenType::eq},
+        {'(', TokenType::open_paren},
+        {')', TokenType::close_paren},
+        {';', TokenType::semi},
+        {'+', TokenType::plus},
+        {'*', TokenType::star},
+        {'-', TokenType::minus},
+        {'%', TokenType::percent},
+        {'{', TokenType::open_curly},
+        {'}', TokenType::close_curly},
+        {',', TokenType::comma},
+    };
+    for (const auto &[c, type] : singles)
+    {
+        table[static_cast<unsigned char>(c)] = {CharClass::single, type};
+    }
+    return table;
+}();
+
+// whether tokens of a type carry text (identifiers and literals)
+inline bool has_text(const TokenType type)
+{
+    return type == TokenType::ident || type == TokenType::int_lit || type == TokenType::float_lit || type == TokenType::char_lit;
+}
+
 // sequence of meaningful characters of the language
+// pos is the byte offset of the token in the source
+// value is the string table id of the text of identifiers and literals, 0 for other tokens
 struct Token
 {
     TokenType type;
-    int line;
-    std::optional<std::string> value{};
+    uint32_t pos;
+    uint32_t value;
+};
+
+// tokens of a source stored as parallel arrays, one byte of type and four bytes each of offset and value per token
+// line numbers are only needed for diagnostics, so they are computed on demand from an index of newline offsets
+class TokenStream
+{
+
+public:
+    // first_line is the line src starts on when it is a slice of a larger file
+    explicit TokenStream(const std::string_view src, const int first_line = 1)
+        : m_src(src), m_first_line(first_line)
+    {
+    }
+
+    void reserve(const size_t count)
+    {
+        m_types.reserve(count);
+        m_pos.reserve(count);
+        m_values.reserve(count);
+    }
+
+    void push(const TokenType type, const uint32_t pos, const uint32_t value = 0)
+    {
+        m_types.push_back(type);
+        m_pos.push_back(pos);
+        m_values.push_back(value);
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_types.size();
+    }
+
+    void resize(const size_t count)
+    {
+        m_types.resize(count);
+        m_pos.resize(count);
+        m_values.resize(count);
+    }
+
+    // copies the tokens of another stream to index at onwards, remap translates its string ids to this stream's
+    void copy_from(const size_t at, const TokenStream &other, const std::vector<uint32_t> &remap)
+    {
+        std::copy(other.m_types.begin(), other.m_types.end(), m_types.begin() + static_cast<ptrdiff_t>(at));
+        std::copy(other.m_pos.begin(), other.m_pos.end(), m_pos.begin() + static_cast<ptrdiff_t>(at));
+        for (size_t i = 0; i < other.size(); i++)
+        {
+            // only tokens with text have a meaningful value
+            m_values[at + i] = has_text(other.m_types[i]) ? remap[other.m_values[i]] : 0;
+        }
+    }
+
+    [[nodiscard]] TokenType type(const size_t index) const
+    {
+        return m_types[index];
+    }
+
+    [[nodiscard]] Token at(const size_t index) const
+    {
+        return {m_types[index], m_pos[index], m_values[index]};
+    }
+
+    // text of an identifier or literal
+    [[nodiscard]] std::string_view text(const Token &token) const
+    {
+        return m_strings.text(token.value);
+    }
+
+    // line of a source offset, counting from the first line of the source
+    [[nodiscard]] int line(const uint32_t pos) const
+    {
+        if (!m_newlines_indexed)
+        {
+            index_newlines();
+        }
+        return static_cast<int>(std::upper_bound(m_newlines.begin(), m_newlines.end(), pos) - m_newlines.begin()) + m_first_line;
+    }
+
+    [[nodiscard]] StringTable &strings()
+    {
+        return m_strings;
+    }
+
+    [[nodiscard]] const StringTable &strings() const
+    {
+        return m_strings;
+    }
+
+private:
+    void index_newlines() const
+    {
+        const char *const begin = m_src.data();
+        const char *const end = begin + m_src.size();
+        for (const char *p = begin; p < end; p++)
+        {
+            p = static_cast<const char *>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+            if (p == nullptr)
+            {
+                break;
+            }
+            m_newlines.push_back(static_cast<uint32_t>(p - begin));
+        }
+        m_newlines_indexed = true;
+    }
+
+    std::string_view m_src;
+    int m_first_line;
+    std::vector<TokenType> m_types;
+    std::vector<uint32_t> m_pos;
+    std::vector<uint32_t> m_values;
+    StringTable m_strings;
+    mutable std::vector<uint32_t> m_newlines; // offsets of '\n' in m_src, built on first use
+    mutable bool m_newlines_indexed = false;
 };
 
 class Tokenizer
 {
 
 public:
-    // takes input .blu file contents as string
-    explicit Tokenizer(std::string src)
-        : m_src(std::move(src))
+    // sources at least this large are split into chunks lexed in parallel
+    static constexpr size_t parallel_min_bytes = 8 * 1024 * 1024;
+
+    // takes a view of the input .blu file contents
+    explicit Tokenizer(const std::string_view src)
+        : m_src(src)
     {
     }
 
-    std::vector<Token> tokenize()
+    // lexes large sources in parallel when the machine has more than one thread
+    TokenStream tokenize()
     {
-        std::vector<Token> tokens;
-        std::string buf;
-        int line_count = 1;
-        while (peek().has_value())
+        const unsigned threads = ThreadPool::hardware_threads();
+        if (threads > 1 && m_src.size() >= parallel_min_bytes)
         {
+            // a few chunks per thread evens out chunks that lex slower than others
+            return tokenize_parallel(threads, m_src.size() / (threads * 4));
+        }
+        return tokenize_serial();
+    }
+
+    TokenStream tokenize_serial()
+    {
+        check_size();
+        TokenStream tokens(m_src);
+        // typical sources average well over four bytes per token, so this avoids regrowing the arrays
+        tokens.reserve(m_src.size() / 4);
+        const LexResult result = lex(m_src.data(), m_src.data() + m_src.size(), false, tokens);
+        if (result.invalid != nullptr)
+        {
+            invalid_token();
+        }
+        return tokens;
+    }
+
+    // splits the source into chunks of about chunk_bytes that end after a newline and lexes them on a thread pool
+    // the only tokens that can span a newline are block comments and a char literal holding a newline,
+    // boundaries are never placed inside such a char literal and each chunk is first lexed assuming it does not start
+    // inside a comment, a chunk that turns out to continue a comment from the previous one is lexed again
+    // the stitched stream is identical to the one from tokenize_serial
+    TokenStream tokenize_parallel(const unsigned threads, const size_t chunk_bytes)
+    {
+        check_size();
+        const std::vector<const char *> bounds = chunk_bounds(std::max<size_t>(chunk_bytes, 1));
+        const size_t count = bounds.size() - 1;
+        std::vector<Chunk> chunks;
+        chunks.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            chunks.push_back({TokenStream(m_src)});
+        }
+        const ThreadPool pool(threads);
+        pool.parallel_for(count, [&](const size_t i)
+                          {
+                              chunks[i].tokens.reserve(static_cast<size_t>(bounds[i + 1] - bounds[i]) / 4);
+                              chunks[i].result = lex(bounds[i], bounds[i + 1], false, chunks[i].tokens); });
+
+        // resolving the comment state at each boundary in order, then merging the string tables in source order
+        // so string ids come out as they would from a serial pass
+        TokenStream tokens(m_src);
+        StringTable &strings = tokens.strings();
+        std::vector<size_t> starts(count);
+        size_t total = 0;
+        bool in_comment = false;
+        for (size_t i = 0; i < count; i++)
+        {
+            Chunk &chunk = chunks[i];
+            if (in_comment)
+            {
+                chunk.tokens = TokenStream(m_src);
+                chunk.result = lex(bounds[i], bounds[i + 1], true, chunk.tokens);
+            }
+            if (chunk.result.invalid != nullptr)
+            {
+                invalid_token();
+            }
+            in_comment = chunk.result.ends_in_comment;
+            const StringTable &local = chunk.tokens.strings();
+            chunk.remap.resize(local.size());
+            for (uint32_t id = 0; id < local.size(); id++)
+            {
+                chunk.remap[id] = strings.intern(local.text(id));
+            }
+            starts[i] = total;
+            total += chunk.tokens.size();
+        }
+
+        tokens.resize(total);
+        pool.parallel_for(count, [&](const size_t i)
+                          { tokens.copy_from(starts[i], chunks[i].tokens, chunks[i].remap); });
+        return tokens;
+    }
+
+private:
+    struct LexResult
+    {
+        bool ends_in_comment = false;   // the range ended inside an unterminated block comment
+        const char *invalid = nullptr; // first character that starts no token, lexing stops there
+    };
+
+    struct Chunk
+    {
+        TokenStream tokens;
+        LexResult result{};
+        std::vector<uint32_t> remap{}; // chunk string id to merged string id
+    };
+
+    // token offsets are 32 bit
+    void check_size() const
+    {
+        if (m_src.size() > UINT32_MAX)
+        {
+            std::cerr << "Source file too large" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    [[noreturn]] static void invalid_token()
+    {
+        std::cerr << "Invalid token" << std::endl;
+        fail();
+    }
+
+    // chunk boundaries, each just after a newline that is not the character of a char literal
+    [[nodiscard]] std::vector<const char *> chunk_bounds(const size_t chunk_bytes) const
+    {
+        const char *const begin = m_src.data();
+        const char *const end = begin + m_src.size();
+        std::vector<const char *> bounds{begin};
+        const char *p = begin + chunk_bytes;
+        while (p < end)
+        {
+            const char *nl = static_cast<const char *>(std::memchr(p, '\n', static_cast<size_t>(end - p)));
+            if (nl == nullptr)
+            {
+                break;
+            }
+            // '\'' '\n' '\'' is a char literal across the boundary
+            if (nl > begin && nl[-1] == '\'')
+            {
+                p = nl + 1;
+                continue;
+            }
+            bounds.push_back(nl + 1);
+            p = nl + 1 + chunk_bytes;
+        }
+        if (bounds.back() != end)
+        {
+            bounds.push_back(end);
+        }
+        return bounds;
+    }
+
+    // walks [p, stop) with raw pointers, runs of whitespace, identifier characters, digits
+    // and comment bodies are skipped in bulk by the scan routines
+    // in_comment starts the range inside a block comment, token offsets are relative to the whole source
+    LexResult lex(const char *p, const char *const end, const bool in_comment, TokenStream &tokens) const
+    {
+        StringTable &strings = tokens.strings();
+        const char *const begin = m_src.data();
+        // offset of a position in the source
+        const auto pos = [&](const char *at)
+        {
+            return static_cast<uint32_t>(at - begin);
+        };
+        // interned text of the source between two positions
+        const auto intern = [&](const char *start, const char *stop)
+        {
+            return strings.intern(m_src.substr(pos(start), static_cast<size_t>(stop - start)));
+        };
+        if (in_comment)
+        {
+            p = scan::find_comment_end(p, end);
+            if (p == end)
+            {
+                return {.ends_in_comment = true};
+            }
+            p += 2;
+        }
+        while (p < end)
+        {
+            const char c = *p;
+            const CharInfo info = char_table[static_cast<unsigned char>(c)];
+            switch (info.cls)
+            {
             // keywords, identifiers cannot start with a number
-            if (std::isalpha(peek().value()))
+            case CharClass::alpha:
             {
-                buf.push_back(consume());
+                const char *start = p;
                 // consecutive characters can be alphabet or number
-                while (peek().has_value() && std::isalnum(peek().value()))
-                {
-                    buf.push_back(consume());
-                }
-                if (buf == "exit")
-                {
-                    tokens.push_back({TokenType::exit, line_count});
-                }
-                else if (buf == "let")
-                {
-                    tokens.push_back({TokenType::let, line_count});
-                }
-                else if (buf == "if")
-                {
-                    tokens.push_back({TokenType::_if, line_count});
-                }
-                else if (buf == "else")
+                p = scan::skip_alnum(p + 1, end);
+                const TokenType type = keyword_or_ident(m_src.substr(pos(start), static_cast<size_t>(p - start)));
+                if (type == TokenType::ident)
                 {
-                    tokens.push_back({TokenType::_else, line_count});
-                }
-                else if (buf == "elif")
-                {
-                    tokens.push_back({TokenType::elif, line_count});
-                }
-                else if (buf == "print")
-                {
-                    tokens.push_back({TokenType::print, line_count});
-                }
-                else if (buf == "function")
-                {
-                    tokens.push_back({TokenType::function, line_count});
+                    tokens.push(TokenType::ident, pos(start), intern(start, p));
                 }
                 else
                 {
-                    tokens.push_back({TokenType::ident, line_count, buf});
+                    tokens.push(type, pos(start));
                 }
-                buf.clear();
+                break;
             }
             // integer literals
-            else if (std::isdigit(peek().value()) || peek().value() == '.')
+            // float literals may omit the integer part (.5), the generator supplies the leading zero
+            case CharClass::number:
             {
-                if(std::isdigit(peek().value()))
+                const char *start = p;
+                p = scan::skip_digits(p, end);
+                if (p < end && *p == '.')
                 {
-                    buf.push_back(consume());
-                    while (peek().has_value() && std::isdigit(peek().value()))
-                    {
-                        buf.push_back(consume());
-                    }
+                    p = scan::skip_digits(p + 1, end);
+                    tokens.push(TokenType::float_lit, pos(start), intern(start, p));
                 }
                 else
                 {
-                    buf.push_back('0');
+                    tokens.push(TokenType::int_lit, pos(start), intern(start, p));
+                }
+                break;
+            }
+            // no tokens for space
+            case CharClass::space:
+                p = scan::skip_space(p, end);
+                break;
+            // tokenising single symbols
+            case CharClass::single:
+                tokens.push(info.type, pos(p));
+                p++;
+                break;
+            case CharClass::slash:
+                p++;
+                // single line comment
+                if (p < end && *p == '/')
+                {
+                    p = scan::find_line_end(p + 1, end);
                 }
-                if(peek().has_value() && peek().value() == '.')
+                // multi line comment
+                else if (p < end && *p == '*')
                 {
-                    buf.push_back(consume());
-                    while (peek().has_value() && std::isdigit(peek().value()))
+                    p = scan::find_comment_end(p + 1, end);
+                    if (p == end)
                     {
-                        buf.push_back(consume());
+                        return {.ends_in_comment = true};
                     }
-                    tokens.push_back({TokenType::float_lit, line_count, buf});
+                    p += 2;
                 }
                 else
                 {
-                    tokens.push_back({TokenType::int_lit, line_count, buf});
+                    tokens.push(TokenType::fslash, pos(p - 1));
                 }
-                buf.clear();
-            }
-            // no tokens for space
-            else if (std::isspace(peek().value()))
-            {
-                if (peek().value() == '\n')
+                break;
+            case CharClass::quote:
+                p++;
+                // the value is the character between the quotes, empty for ''
+                if (p < end && *p == '\'')
                 {
-                    line_count++;
+                    tokens.push(TokenType::char_lit, pos(p - 1), intern(p, p));
                 }
-                consume();
-            }
-            else
-            {
-                // tokenising single symbols
-                char c = peek().value();
-                switch (c)
+                else if (end - p >= 2 && p[1] == '\'')
                 {
-                case '=':
-                    consume();
-                    tokens.push_back({TokenType::eq, line_count});
-                    break;
-                case '(':
-                    consume();
-                    tokens.push_back({TokenType::open_paren, line_count});
-                    break;
-                case ')':
-                    consume();
-                    tokens.push_back({TokenType::close_paren, line_count});
-                    break;
-                case ';':
-                    consume();
-                    tokens.push_back({TokenType::semi, line_count});
-                    break;
-                case '+':
-                    consume();
-                    tokens.push_back({TokenType::plus, line_count});
-                    break;
-                case '*':
-                    consume();
-                    tokens.push_back({TokenType::star, line_count});
-                    break;
-                case '-':
-                    consume();
-                    tokens.push_back({TokenType::minus, line_count});
-                    break;
-                case '/':
-                    consume();
-                    // single line comment
-                    if (peek().has_value() && peek().value() == '/')
-                    {
-                        consume();
-                        while (peek().has_value() && peek().value() != '\n')
-                        {
-                            consume();
-                        }
-                        line_count++;
-                    }
-                    // multi line comment
-                    else if (peek().has_value() && peek().value() == '*')
-                    {
-                        consume();
-                        while (peek().has_value())
-                        {
-                            if (peek().value() == '*' && peek(1).has_value() && peek(1).value() == '/')
-                            {
-                                break;
-                            }
-                            if (consume() == '\n')
-                            {
-                                line_count++;
-                            }
-                        }
-                        if (peek().has_value() && peek().value() == '*')
-                            consume();
-                        if (peek().has_value() && peek().value() == '/')
-                            consume();
-                    }
-                    else
-                    {
-                        tokens.push_back({TokenType::fslash, line_count});
-                    }
-                    break;
-                case '%':
-                    consume();
-                    tokens.push_back({TokenType::percent, line_count});
-                    break;
-                case '{':
-                    consume();
-                    tokens.push_back({TokenType::open_curly, line_count});
-                    break;
-                case '}':
-                    consume();
-                    tokens.push_back({TokenType::close_curly, line_count});
-                    break;
-                case '\'':
-                    consume();
-                    if(peek().has_value() && peek().value() == '\'')
-                    {
-                        tokens.push_back({TokenType::char_lit, line_count, ""});                    
-                    }
-                    else if(peek(1).has_value() && peek(1).value() == '\'')
-                    {
-                        tokens.push_back({TokenType::char_lit, line_count, std::to_string(consume())});
-                    }
-                    consume();
-                    break;
-                case ',':
-                    consume();
-                    tokens.push_back({TokenType::comma, line_count});
-                    break;
-                case '\n':
-                    consume();
-                    line_count++;
-                    break;
-                default:
-                    std::cerr << "Invalid token" << std::endl;
-                    exit(EXIT_FAILURE);
+                    tokens.push(TokenType::char_lit, pos(p - 1), intern(p, p + 1));
+                    p++;
                 }
+                p = std::min(p + 1, end);
+                break;
+            default:
+                return {.invalid = p};
             }
         }
-        m_index = 0;
-        return tokens;
-    }
-
-private:
-    // for peeking next character
-    [[nodiscard]] std::optional<char> peek(const size_t offset = 0) const
-    {
-        if (m_index + offset >= m_src.length())
-        {
-            return {};
-        }
-        return m_src.at(m_index + offset);
-    }
-
-    // consuming character
-    char consume()
-    {
-        return m_src.at(m_index++);
+        return {};
     }
 
-    size_t m_index = 0;
-    const std::string m_src;
-};
\ No newline at end of file
+    const std::string_view m_src;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <csignal>
+#include <cstdint>
+#include <vector>
+
+#include "./bytecode.hpp"
+
+// runs bytecode to its end and returns its exit status as a process would have it
+// dispatch is threaded, every handler jumps straight to the handler of the next instruction through a table of label
+// addresses (computed goto, a GCC and Clang extension like the unsigned __int128 of instruction selection), so each
+// instruction has an indirect jump of its own for the branch predictor to learn
+// division by zero raises SIGFPE, as the div instruction of the machine code does
+inline int run_bytecode(const Bytecode &bytecode)
+{
+    static const void *const handlers[] = {
+        &&op_move, &&op_add, &&op_sub, &&op_mul, &&op_udiv, &&op_urem,
+        &&op_jmp, &&op_jz, &&op_jnz, &&op_jeq, &&op_jne, &&op_exit};
+    std::vector<uint64_t> registers = bytecode.registers;
+    uint64_t *const r = registers.data();
+    const BcInst *const code = bytecode.code.data();
+    const BcInst *ip = code;
+
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_move:
+    r[ip->a] = r[ip->b];
+    ip++;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_add:
+    r[ip->a] = r[ip->b] + r[ip->c];
+    ip++;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_sub:
+    r[ip->a] = r[ip->b] - r[ip->c];
+    ip++;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_mul:
+    r[ip->a] = r[ip->b] * r[ip->c];
+    ip++;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_udiv:
+    if (r[ip->c] == 0)
+    {
+        std::raise(SIGFPE);
+    }
+    r[ip->a] = r[ip->b] / r[ip->c];
+    ip++;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_urem:
+    if (r[ip->c] == 0)
+    {
+        std::raise(SIGFPE);
+    }
+    r[ip->a] = r[ip->b] % r[ip->c];
+    ip++;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_jmp:
+    ip = code + ip->a;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_jz:
+    ip = r[ip->b] == 0 ? code + ip->a : ip + 1;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_jnz:
+    ip = r[ip->b] != 0 ? code + ip->a : ip + 1;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_jeq:
+    ip = r[ip->b] == r[ip->c] ? code + ip->a : ip + 1;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_jne:
+    ip = r[ip->b] != r[ip->c] ? code + ip->a : ip + 1;
+    goto *handlers[static_cast<uint8_t>(ip->op)];
+op_exit:
+    return static_cast<int>(r[ip->a] & 0xFF);
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <span>
+#include <sstream>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "./generator.hpp"
+
+// recompiles a .blu file every time it is saved, redoing only the work the edit affects
+// the program is kept as a list of units, one per top-level statement, each with its tokens, parse tree and code
+// an edit re-lexes and re-parses the units around the changed bytes, and regenerates code from the first changed unit
+// until an unchanged unit is entered with the generator state it was generated from before
+// each unit is encoded on its own, the program is their machine code concatenated with the jumps patched across it
+class WatchSession
+{
+
+public:
+    // link is called with the machine code of the whole program after every successful compile
+    WatchSession(std::string path, std::function<void(std::span<const uint8_t>)> link)
+        : m_path(std::move(path)), m_link(std::move(link))
+    {
+        m_epilogue_code = std::make_unique<X86Encoder>(m_strings);
+        m_generator.set_encoder(m_epilogue_code.get());
+        m_generator.gen_epilogue();
+    }
+
+    // for --emit-asm, the units are generated as assembly and assemble is called with that of the whole program
+    WatchSession(std::string path, std::function<void(const std::string &)> assemble)
+        : m_path(std::move(path)), m_assemble(std::move(assemble))
+    {
+        m_generator.gen_prologue();
+        m_prologue = m_generator.take_output();
+        m_generator.gen_epilogue();
+        m_epilogue = m_generator.take_output();
+    }
+
+    // compiles once and then again after every change to the file, never returns
+    [[noreturn]] void run()
+    {
+        throw_on_error() = true;
+        const size_t slash = m_path.rfind('/');
+        const std::string dir = slash == std::string::npos ? "." : m_path.substr(0, slash + 1);
+        const std::string name = slash == std::string::npos ? m_path : m_path.substr(slash + 1);
+        // the directory is watched rather than the file, editors often save by replacing the file
+        const int fd = inotify_init1(IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+            std::cerr << "Unable to watch " << dir << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        update(read_file());
+        alignas(inotify_event) char events[sizeof(inotify_event) + NAME_MAX + 1];
+        while (true)
+        {
+            const ssize_t n = read(fd, events, sizeof(events));
+            bool changed = false;
+            for (ssize_t at = 0; at < n;)
+            {
+                const auto *event = reinterpret_cast<const inotify_event *>(events + at);
+                changed = changed || (event->len > 0 && name == event->name);
+                at += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+            }
+            if (changed)
+            {
+                update(read_file());
+            }
+        }
+    }
+
+    // recompiles after the source changed to text
+    void update(std::string text)
+    {
+        if (m_built && text == m_text)
+        {
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        m_relexed_bytes = 0;
+        m_reparsed = 0;
+        m_regenerated = 0;
+        // after a parse error the units still match the last text that parsed, the next edit is diffed against it
+        if (!reparse(text))
+        {
+            return;
+        }
+        m_text = std::move(text);
+        if (!regenerate())
+        {
+            return;
+        }
+        build();
+        m_built = true;
+        const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "[watch] rebuilt in " << ms << " ms: re-lexed " << m_relexed_bytes << " bytes, re-parsed "
+                  << m_reparsed << " of " << m_units.size() << " statements, regenerated " << m_regenerated << std::endl;
+    }
+
+private:
+    // tokens and parse tree of a run of top-level statements, shared by the units parsed together
+    struct Batch
+    {
+        Batch(std::string source, const int first_line)
+            : text(std::move(source)), tokens(text, first_line), parser(tokens)
+        {
+        }
+
+        std::string text;
+        TokenStream tokens;
+        Parser parser;
+    };
+
+    // one top-level statement
+    struct Unit
+    {
+        size_t begin;                 // offset of the first token in the current text, a unit runs to the next one
+        std::shared_ptr<Batch> batch; // owns the statement
+        size_t token_begin;           // tokens of the statement in the batch
+        size_t token_end;
+        const NodeStmt *stmt;
+        Generator::Mark entry{}; // generator state before the statement, valid for the first unit not generated
+        bool generated = false;  // whether code is up to date
+        std::string code{};      // assembly, for --emit-asm
+        std::unique_ptr<X86Encoder> machine_code{}; // otherwise machine code, with its jumps not patched yet
+        std::vector<uint32_t> assigned{}; // names of the variables the statement assigns to
+        std::vector<uint32_t> read{};     // names of the identifiers the statement reads
+    };
+
+    std::string read_file() const
+    {
+        std::stringstream contents;
+        const std::fstream input(m_path, std::ios::in);
+        contents << input.rdbuf();
+        return contents.str();
+    }
+
+    // end of a unit in the current text
+    [[nodiscard]] size_t unit_end(const size_t i) const
+    {
+        return i + 1 < m_units.size() ? m_units[i + 1].begin : m_text.size();
+    }
+
+    // re-lexes and re-parses the units the difference between m_text and text touches
+    bool reparse(const std::string &text)
+    {
+        // the edit replaced [prefix, old size - suffix) of the old text
+        size_t prefix = 0;
+        const size_t common = std::min(m_text.size(), text.size());
+        while (prefix < common && m_text[prefix] == text[prefix])
+        {
+            prefix++;
+        }
+        size_t suffix = 0;
+        while (suffix < common - prefix && m_text[m_text.size() - 1 - suffix] == text[text.size() - 1 - suffix])
+        {
+            suffix++;
+        }
+        const size_t changed_end = m_text.size() - suffix;
+        // units overlapping the edit, plus the unit before them since the edit may extend it (an else after an if)
+        size_t first = 0;
+        while (first + 1 < m_units.size() && unit_end(first) <= prefix)
+        {
+            first++;
+        }
+        size_t last = first;
+        while (last + 1 < m_units.size() && m_units[last + 1].begin < changed_end)
+        {
+            last++;
+        }
+        first = first > 0 ? first - 1 : 0;
+        const size_t end = std::min(last + 1, m_units.size());
+        if (end == m_units.size())
+        {
+            return replace_units(text, first, end);
+        }
+        // the changed units may not parse on their own (an unclosed scope swallows what follows) or may change how
+        // the rest lexes (an unclosed comment), so on failure everything to the end is parsed again before the error
+        // is reported
+        std::stringstream errors;
+        std::streambuf *cerr = std::cerr.rdbuf(errors.rdbuf());
+        const bool ok = replace_units(text, first, end);
+        std::cerr.rdbuf(cerr);
+        return ok || replace_units(text, first, m_units.size());
+    }
+
+    // replaces units [first, last) with the statements parsed from the same region of the new text
+    // the region is lexed through unit last too, the edit left the rest of the text alone only if that unit comes out
+    // with the same tokens and starts a statement where it did before
+    bool replace_units(const std::string &text, const size_t first, const size_t last)
+    {
+        const size_t delta = text.size() - m_text.size();
+        const size_t begin = first > 0 ? m_units[first].begin : 0;
+        const bool resync = last < m_units.size();
+        const size_t end = (resync ? unit_end(last) : m_text.size()) + delta;
+        const int first_line = 1 + static_cast<int>(std::count(text.begin(), text.begin() + static_cast<ptrdiff_t>(begin), '\n'));
+        std::vector<Unit> units;
+        try
+        {
+            auto batch = std::make_shared<Batch>(text.substr(begin, end - begin), first_line);
+            m_relexed_bytes += batch->text.size();
+            // lexing into a scratch stream, then moving its texts into the session's string table so ids stay
+            // valid across edits
+            const TokenStream scratch = Tokenizer(batch->text).tokenize_serial();
+            std::vector<uint32_t> remap(scratch.strings().size());
+            for (uint32_t id = 0; id < remap.size(); id++)
+            {
+                remap[id] = m_strings.intern(scratch.strings().text(id));
+            }
+            batch->tokens.resize(scratch.size());
+            batch->tokens.copy_from(0, scratch, remap);
+            size_t stop = batch->tokens.size();
+            if (resync)
+            {
+                stop = 0;
+                while (stop < batch->tokens.size() && begin + batch->tokens.at(stop).pos < m_units[last].begin + delta)
+                {
+                    stop++;
+                }
+            }
+            while (batch->parser.index() < stop)
+            {
+                const size_t at = batch->parser.index();
+                const std::optional<NodeStmt *> stmt = batch->parser.parse_stmt();
+                if (!stmt.has_value())
+                {
+                    batch->parser.error_expected("statement");
+                }
+                units.push_back({begin + batch->tokens.at(at).pos, batch, at, batch->parser.index(), stmt.value()});
+                m_generator.collect_assigned(stmt.value(), units.back().assigned);
+                m_generator.collect_read(stmt.value(), units.back().read);
+            }
+            if (resync && !same_tokens(*batch, stop, m_units[last], m_units[last].begin + delta - begin))
+            {
+                return false;
+            }
+        }
+        catch (const CompileError &)
+        {
+            return false;
+        }
+        m_reparsed += units.size();
+        // the new units are entered in the same state as the first unit they replace
+        const Generator::Mark entry = first < m_units.size() ? m_units[first].entry : Generator::Mark{};
+        if (!units.empty())
+        {
+            units.front().entry = entry;
+        }
+        for (size_t i = last; i < m_units.size(); i++)
+        {
+            m_units[i].begin += delta;
+        }
+        m_units.erase(m_units.begin() + static_cast<ptrdiff_t>(first), m_units.begin() + static_cast<ptrdiff_t>(last));
+        m_units.insert(m_units.begin() + static_cast<ptrdiff_t>(first), std::make_move_iterator(units.begin()), std::make_move_iterator(units.end()));
+        if (units.empty() && first < m_units.size())
+        {
+            // statements were removed and none took their place, the one after them is entered where they were
+            m_units[first].entry = entry;
+            m_units[first].generated = false;
+        }
+        // the code of a statement depends on the statements following it, see Generator::gen_stmt()
+        for (size_t i = first - std::min(first, Generator::look_ahead); i < first; i++)
+        {
+            m_units[i].generated = false;
+        }
+        return true;
+    }
+
+    // whether the tokens of batch from index at on are those of unit, with the first one at offset pos of the batch
+    static bool same_tokens(const Batch &batch, const size_t at, const Unit &unit, const size_t pos)
+    {
+        const TokenStream &old = unit.batch->tokens;
+        if (batch.parser.index() != at || batch.tokens.size() - at != unit.token_end - unit.token_begin ||
+            at == batch.tokens.size() || batch.tokens.at(at).pos != pos)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < unit.token_end - unit.token_begin; i++)
+        {
+            const Token token = batch.tokens.at(at + i);
+            const Token before = old.at(unit.token_begin + i);
+            if (token.type != before.type || token.value != before.value || token.pos - pos != before.pos - old.at(unit.token_begin).pos)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // sorted names of a list every unit has
+    std::vector<uint32_t> program_names(std::vector<uint32_t> Unit::*names) const
+    {
+        std::vector<uint32_t> all;
+        for (const Unit &unit : m_units)
+        {
+            all.insert(all.end(), (unit.*names).begin(), (unit.*names).end());
+        }
+        std::sort(all.begin(), all.end());
+        all.erase(std::unique(all.begin(), all.end()), all.end());
+        return all;
+    }
+
+    // the code of the program is the concatenation of its units
+    void build() const
+    {
+        if (m_assemble)
+        {
+            std::string code = m_prologue;
+            for (const Unit &unit : m_units)
+            {
+                code += unit.code;
+            }
+            code += m_epilogue;
+            m_assemble(code);
+            return;
+        }
+        X86Encoder program(m_strings);
+        for (const Unit &unit : m_units)
+        {
+            program.append(*unit.machine_code);
+        }
+        program.append(*m_epilogue_code);
+        program.finish();
+        m_link(program.code());
+    }
+
+    // generates code for units that are new or whose entry state changed
+    bool regenerate()
+    {
+        // a variable is a constant only if no statement assigns its name and has a stack slot only if a statement
+        // reads it, so when the assigned or read names change the code before the edit may change too and everything
+        // is generated again
+        std::vector<uint32_t> assigned = program_names(&Unit::assigned);
+        std::vector<uint32_t> read = program_names(&Unit::read);
+        if (assigned != m_assigned || read != m_read)
+        {
+            m_assigned = std::move(assigned);
+            m_read = std::move(read);
+            m_generator.set_assigned(m_assigned);
+            m_generator.set_read(m_read);
+            for (Unit &unit : m_units)
+            {
+                unit.generated = false;
+            }
+        }
+        size_t i = 0;
+        while (i < m_units.size() && m_units[i].generated)
+        {
+            i++;
+        }
+        if (i == m_units.size())
+        {
+            return true;
+        }
+        // variables of the previous generation, the units after the last regenerated one still refer to them
+        const std::vector<Generator::Var> previous = m_generator.vars();
+        const size_t unchanged_vars = m_units[i].entry.var_count;
+        m_generator.rewind(m_units[i].entry);
+        try
+        {
+            for (; i < m_units.size(); i++)
+            {
+                Unit &unit = m_units[i];
+                const Generator::Mark entry = m_generator.mark();
+                // once an unchanged unit is entered in the state it was generated from, the rest is unchanged too
+                const std::vector<Generator::Var> &vars = m_generator.vars();
+                if (unit.generated && unit.entry == entry && entry.var_count <= previous.size() &&
+                    std::equal(vars.begin() + static_cast<ptrdiff_t>(unchanged_vars), vars.end(), previous.begin() + static_cast<ptrdiff_t>(unchanged_vars)))
+                {
+                    m_generator.set_vars(previous);
+                    break;
+                }
+                unit.entry = entry;
+                unit.generated = false;
+                m_following.clear();
+                for (size_t j = i + 1; j < m_units.size() && j <= i + Generator::look_ahead; j++)
+                {
+                    m_following.push_back(m_units[j].stmt);
+                }
+                if (!m_assemble)
+                {
+                    unit.machine_code = std::make_unique<X86Encoder>(m_strings);
+                    m_generator.set_encoder(unit.machine_code.get());
+                }
+                m_generator.gen_stmt(unit.stmt, m_following);
+                unit.code = m_generator.take_output();
+                unit.generated = true;
+                m_regenerated++;
+            }
+        }
+        catch (const CompileError &)
+        {
+            m_generator.take_output();
+            for (; i < m_units.size(); i++)
+            {
+                m_units[i].generated = false;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    std::string m_path;
+    std::function<void(std::span<const uint8_t>)> m_link; // see the constructors, one of the two is set
+    std::function<void(const std::string &)> m_assemble;
+    std::string m_text;                     // source the units were parsed from
+    std::vector<Unit> m_units;              // top-level statements in source order
+    bool m_built = false;                   // whether the last update produced a program
+    StringTable m_strings{true};            // text of every identifier and literal seen so far
+    Generator m_generator{{}, m_strings};   // keeps the variables of the last generation between updates
+    std::vector<uint32_t> m_assigned;       // sorted names assigned anywhere in the program
+    std::vector<uint32_t> m_read;           // sorted names read anywhere in the program
+    std::vector<const NodeStmt *> m_following; // statements after the one being generated
+    std::string m_prologue, m_epilogue;     // assembly before and after the statements
+    std::unique_ptr<X86Encoder> m_epilogue_code; // machine code after the statements, there is none before them
+    size_t m_relexed_bytes = 0;
+    size_t m_reparsed = 0;
+    size_t m_regenerated = 0;
+};
@@ -0,0 +1,103 @@
+// lexes generated sources in parallel with chunks from one byte up and checks the tokens and string ids against a
+// serial pass, Tokenizer::tokenize() only goes parallel for sources of 8 MiB and more
+// the sources are built from pieces that end lines in the awkward places: block comments over several lines, line
+// comments longer than a chunk, char literals holding a newline and quotes just before one
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "../src/tokenization.hpp"
+
+namespace
+{
+constexpr std::string_view pieces[] = {
+    "let x = 42;\n",
+    "let value1 = (x + 7) * 3 / 2 % 5;\n",
+    "if (x) { print(x); } elif (y) { exit(1); } else { x = 0; }\n",
+    "function f(a, b) { exit(a - b); }\n",
+    "let pi = 3.25;\n",
+    "x = x + 1; ",
+    "// a line comment with /* and ' in it\n",
+    "// a line comment longer than many of the chunks, so the boundary after it is pushed past where it was "
+    "aimed, and it goes on for a while before it ends\n",
+    "/* a block comment\nover three lines, with // and '\n' inside\n*/ let y = 1;\n",
+    "/**/\n",
+    "/* one line */ x = 2;\n",
+    "let c = '\n';\n",
+    "let d = '\n'\n;\n",
+    "let e = 'a'\n;\n",
+    "let q = ''\n;\n",
+    "'\n",
+    "\n\n",
+    "    \t ",
+};
+
+// a source of about bytes bytes, sometimes ending inside a block comment
+std::string generate(std::mt19937 &random, const size_t bytes)
+{
+    std::string source;
+    while (source.size() < bytes)
+    {
+        source += pieces[random() % std::size(pieces)];
+    }
+    if (random() % 4 == 0)
+    {
+        source += "/* not closed\n let z = 3;\n";
+    }
+    return source;
+}
+
+// reports the first difference between the two streams, if any
+bool same(const TokenStream &serial, const TokenStream &parallel, const size_t chunk_bytes)
+{
+    if (serial.strings().size() != parallel.strings().size())
+    {
+        std::cerr << "chunks of " << chunk_bytes << " bytes: " << parallel.strings().size() << " strings, not "
+                  << serial.strings().size() << std::endl;
+        return false;
+    }
+    if (serial.size() != parallel.size())
+    {
+        std::cerr << "chunks of " << chunk_bytes << " bytes: " << parallel.size() << " tokens, not " << serial.size()
+                  << std::endl;
+        return false;
+    }
+    for (size_t i = 0; i < serial.size(); i++)
+    {
+        const Token want = serial.at(i);
+        const Token got = parallel.at(i);
+        if (got.type != want.type || got.pos != want.pos || got.value != want.value ||
+            (has_text(want.type) && parallel.text(got) != serial.text(want)))
+        {
+            std::cerr << "chunks of " << chunk_bytes << " bytes: token " << i << " at " << got.pos << " is "
+                      << to_string(got.type) << ", not " << to_string(want.type) << " at " << want.pos << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+}
+
+int main()
+{
+    std::mt19937 random(1);
+    for (int round = 0; round < 20; round++)
+    {
+        const std::string source = generate(random, 400 + random() % 1600);
+        Tokenizer tokenizer(source);
+        const TokenStream serial = tokenizer.tokenize_serial();
+        for (size_t chunk_bytes = 1; chunk_bytes <= 1000; chunk_bytes += chunk_bytes < 64 ? 1 : 97)
+        {
+            const unsigned threads = 1 + static_cast<unsigned>(chunk_bytes % 4);
+            if (!same(serial, tokenizer.tokenize_parallel(threads, chunk_bytes), chunk_bytes))
+            {
+                std::cerr << "source:\n" << source << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}